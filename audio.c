@@ -0,0 +1,278 @@
+/*****************************************************************************
+ * audio.c: the audio of the clip as W64 or raw PCM, written along with the video (-a)
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *****************************************************************************/
+
+/* The audio comes from the same script environment as the video, so the script is only
+ * evaluated once. A thread of its own follows the main loop: once output frames are done,
+ * it fetches the samples that go with them, range by range of the schedule. Frame n of
+ * the output timing starts at sample n * rate / fps, as in AviSynth. The clip is not to be
+ * asked for frames and samples from two threads at once, so whoever renders the video on
+ * this environment, the main loop or the first prefetch worker, holds audio_render too.
+ *
+ * W64 is RIFF with GUIDs and 64-bit sizes. The sizes in the header are those of the
+ * whole schedule; they are fixed up at the end if the run stops early and the file is seekable. */
+
+#define AUDIO_BLOCK (1 << 20)           // bytes fetched from the clip at a time
+
+static pthread_mutex_t audio_render = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    const char *name;
+    int raw;                    // -rawaudio: no W64 header
+    int fd;
+    avs_hnd_t *avs_h;
+    const AVS_VideoInfo *inf;   // the output timing, with the audio of the clip
+    const schedule_t *sched;
+    int sample_size;            // bytes per sample of one channel
+    int64_t header_len;
+    int64_t expect;             // bytes of samples for the whole schedule
+    int64_t bytes;              // bytes of samples written
+    BYTE *buf;
+    int ready;                  // output frames the main loop is done with
+    int pos;                    // output frames whose audio is written
+    int started;
+    int closed;
+    int error;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} audio_out_t;
+
+static int audio_sample_size(int sample_type)
+{
+    switch(sample_type) {
+    case AVS_SAMPLE_INT8:  return 1;
+    case AVS_SAMPLE_INT16: return 2;
+    case AVS_SAMPLE_INT24: return 3;
+    case AVS_SAMPLE_INT32:
+    case AVS_SAMPLE_FLOAT: return 4;
+    }
+    return 0;
+}
+
+/* first sample of frame frm, clipped to the end of the audio */
+static int64_t audio_frame_sample(const AVS_VideoInfo *inf, int frm)
+{
+    int64_t s = (int64_t)frm * inf->audio_samples_per_second * inf->fps_denominator / inf->fps_numerator;
+    return s < inf->num_audio_samples ? s : inf->num_audio_samples;
+}
+
+static void audio_put(BYTE **p, uint64_t v, int bytes)
+{
+    for(int i = 0; i < bytes; i++, v >>= 8)
+        *(*p)++ = v;
+}
+
+/* the W64 header for 'data' bytes of samples; returns its size */
+static int audio_w64_header(const audio_out_t *a, BYTE *buf, int64_t data)
+{
+    static const BYTE riff[16] = {'r','i','f','f', 0x2e,0x91,0xcf,0x11, 0xa5,0xd6,0x28,0xdb, 0x04,0xc1,0x00,0x00};
+    static const BYTE guid_tail[12] = {0xf3,0xac,0xd3,0x11, 0x8c,0xd1,0x00,0xc0, 0x4f,0x8e,0xdb,0x8a};
+    static const BYTE subformat_tail[14] = {0x00,0x00, 0x00,0x00, 0x10,0x00, 0x80,0x00, 0x00,0xaa,0x00,0x38,0x9b,0x71};
+    static const uint32_t masks[9] = {0, 0x4, 0x3, 0x7, 0x33, 0x37, 0x3f, 0x13f, 0x63f};
+    const AVS_VideoInfo *inf = a->inf;
+    int is_float = inf->sample_type == AVS_SAMPLE_FLOAT;
+    int bits = a->sample_size * 8;
+    int block = a->sample_size * inf->nchannels;
+    // plain PCM and float for up to stereo and 16 bits, WAVE_FORMAT_EXTENSIBLE otherwise
+    int extensible = inf->nchannels > 2 || (bits > 16 && !is_float);
+    int fmt_len = extensible ? 40 : 18;
+    int fmt_chunk = 24 + (fmt_len + 7) / 8 * 8;
+    BYTE *p = buf;
+    memcpy(p, riff, 16);
+    p += 16;
+    audio_put(&p, 40 + fmt_chunk + 24 + (data + 7) / 8 * 8, 8);
+    memcpy(p, "wave", 4);
+    memcpy(p + 4, guid_tail, 12);
+    memcpy(p + 16, "fmt ", 4);
+    memcpy(p + 20, guid_tail, 12);
+    p += 32;
+    audio_put(&p, fmt_chunk, 8);
+    audio_put(&p, extensible ? 0xfffe : is_float ? 3 : 1, 2);
+    audio_put(&p, inf->nchannels, 2);
+    audio_put(&p, inf->audio_samples_per_second, 4);
+    audio_put(&p, (uint64_t)inf->audio_samples_per_second * block, 4);
+    audio_put(&p, block, 2);
+    audio_put(&p, bits, 2);
+    audio_put(&p, fmt_len - 18, 2);
+    if(extensible) {
+        audio_put(&p, bits, 2);
+        audio_put(&p, inf->nchannels < 9 ? masks[inf->nchannels] : 0, 4);
+        audio_put(&p, is_float ? 3 : 1, 2);
+        memcpy(p, subformat_tail, 14);
+        p += 14;
+    }
+    for(; (p - buf) % 8; p++)
+        *p = 0;
+    memcpy(p, "data", 4);
+    memcpy(p + 4, guid_tail, 12);
+    p += 16;
+    audio_put(&p, 24 + data, 8);
+    return p - buf;
+}
+
+static int audio_write_all(int fd, const BYTE *buf, size_t size)
+{
+    while(size) {
+        ssize_t ret = write(fd, buf, size);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return -1;
+        buf += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+/* fetches and writes the samples of output frames [from, to) */
+static int audio_write_frames(audio_out_t *a, int from, int to)
+{
+    avs_hnd_t *avs_h = a->avs_h;
+    int block = a->sample_size * a->inf->nchannels;
+    while(from < to) {
+        const frame_range_t *r = &a->sched->range[schedule_find(a->sched, from)];
+        int end = r->pos + r->end - r->first < to ? r->pos + r->end - r->first : to;
+        int64_t start = audio_frame_sample(a->inf, r->first + from - r->pos);
+        int64_t stop = audio_frame_sample(a->inf, r->first + end - r->pos);
+        while(start < stop) {
+            int64_t count = stop - start < AUDIO_BLOCK / block ? stop - start : AUDIO_BLOCK / block;
+            pthread_mutex_lock(&audio_render);
+            int err = avs_h->func.avs_get_audio(avs_h->clip, a->buf, start, count);
+            pthread_mutex_unlock(&audio_render);
+            if(err) {
+                fprintf(stderr, "Error: failed to read audio samples from %"PRId64".\n", start);
+                return -1;
+            }
+            if(audio_write_all(a->fd, a->buf, count * block)) {
+                fprintf(stderr, "Error: failed to write to \"%s\".\n", a->name);
+                return -1;
+            }
+            a->bytes += count * block;
+            start += count;
+        }
+        from = end;
+    }
+    return 0;
+}
+
+static void *audio_thread(void *arg)
+{
+    audio_out_t *a = arg;
+    pin_thread(0);
+    pthread_mutex_lock(&a->mutex);
+    for(;;) {
+        while(a->pos == a->ready && !a->closed)
+            pthread_cond_wait(&a->cond, &a->mutex);
+        if(a->pos == a->ready)
+            break;
+        int from = a->pos, to = a->ready;
+        pthread_mutex_unlock(&a->mutex);
+        int err = audio_write_frames(a, from, to);
+        pthread_mutex_lock(&a->mutex);
+        a->pos = to;
+        if(err) {
+            a->error = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&a->mutex);
+    return NULL;
+}
+
+/* opens the output, writes the header and starts the thread */
+static int audio_start(audio_out_t *a, avs_hnd_t *avs_h, const AVS_VideoInfo *inf, const schedule_t *sched)
+{
+    a->avs_h = avs_h;
+    a->inf = inf;
+    a->sched = sched;
+    a->sample_size = audio_sample_size(inf->sample_type);
+    if(!avs_has_audio(inf) || !inf->nchannels || !a->sample_size) {
+        fprintf(stderr, "Error: -a: the clip has no audio in a format that can be written.\n");
+        return -1;
+    }
+    for(int r = 0; r < sched->count; r++)
+        a->expect += (audio_frame_sample(inf, sched->range[r].end) - audio_frame_sample(inf, sched->range[r].first)) *
+                     a->sample_size * inf->nchannels;
+    if(!strcmp(a->name, "-")) {
+        a->fd = dup(fileno(stdout));
+        fclose(stdout);
+        #if defined(AVS_WINDOWS)
+        _setmode(a->fd, _O_BINARY);
+        #endif
+    } else
+        a->fd = open(a->name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if(a->fd < 0) {
+        fprintf(stderr, "Error: failed to create/open \"%s\".\n", a->name);
+        return -1;
+    }
+    BYTE header[128];
+    a->header_len = a->raw ? 0 : audio_w64_header(a, header, a->expect);
+    if(a->header_len && audio_write_all(a->fd, header, a->header_len)) {
+        fprintf(stderr, "Error: failed to write to \"%s\".\n", a->name);
+        return -1;
+    }
+    if(!(a->buf = malloc(AUDIO_BLOCK)))
+        return -1;
+    pthread_mutex_init(&a->mutex, NULL);
+    pthread_cond_init(&a->cond, NULL);
+    if(pthread_create(&a->thread, NULL, audio_thread, a)) {
+        pthread_cond_destroy(&a->cond);
+        pthread_mutex_destroy(&a->mutex);
+        return -1;
+    }
+    a->started = 1;
+    return 0;
+}
+
+/* the main loop is done with the first 'frames' output frames; fails once the thread gave up */
+static int audio_advance(audio_out_t *a, int frames)
+{
+    pthread_mutex_lock(&a->mutex);
+    a->ready = frames;
+    pthread_cond_signal(&a->cond);
+    int err = a->error;
+    pthread_mutex_unlock(&a->mutex);
+    return err ? -1 : 0;
+}
+
+/* waits for the thread to write everything it was handed and fixes up the header if the
+ * run was cut short; with 'drop' set it only stops the thread and closes the file */
+static int audio_finish(audio_out_t *a, int drop)
+{
+    int err = 0;
+    if(a->started) {
+        pthread_mutex_lock(&a->mutex);
+        a->closed = 1;
+        if(drop)
+            a->ready = a->pos;
+        pthread_cond_signal(&a->cond);
+        pthread_mutex_unlock(&a->mutex);
+        pthread_join(a->thread, NULL);
+        pthread_cond_destroy(&a->cond);
+        pthread_mutex_destroy(&a->mutex);
+        a->started = 0;
+    }
+    free(a->buf);
+    a->buf = NULL;
+    if(a->fd < 0)
+        return 0;
+    if(!drop && !a->error && a->header_len) {
+        static const BYTE pad[8];
+        BYTE header[128];
+        // W64 chunks are padded to 8 bytes
+        err = a->bytes % 8 && audio_write_all(a->fd, pad, 8 - a->bytes % 8);
+        if(!err && a->bytes != a->expect && fd_seek(a->fd, 0, SEEK_SET) == 0)
+            err = audio_write_all(a->fd, header, audio_w64_header(a, header, a->bytes));
+    }
+    err |= close(a->fd);
+    a->fd = -1;
+    if(err && !drop)
+        fprintf(stderr, "Error: failed to write to \"%s\".\n", a->name);
+    return err || a->error ? -1 : 0;
+}
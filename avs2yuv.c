@@ -9,16 +9,37 @@
 // the Free Software Foundation; either version 2 of the License, or
 // (at your option) any later version.
 
+#if defined(__linux__)
+#define _GNU_SOURCE // vmsplice, F_SETPIPE_SZ, O_DIRECT, fallocate, sync_file_range
+#endif
+
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
 #include "avs_internal.c"
 
 #if defined(AVS_POSIX)
 #include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+#include <poll.h>
+#include <sys/ioctl.h>
+#define AVS_SPLICE
+#endif
+#define O_BINARY 0
 #if defined(AVS_MACOS)
 #define AVS_LIBNAME "libavisynth.dylib"
 #else
@@ -38,6 +59,10 @@ typedef signed __int64 int64_t;
 #define OLD_TIME_BEHAVIOR
 #endif
 #define AVS_LIBNAME "avisynth.dll"
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
 #endif
 
 #if defined(AVS_MACOS)
@@ -60,17 +85,55 @@ typedef signed __int64 int64_t;
 #define INT_MAX 0x7fffffff
 #endif
 
+#if !defined(IOV_MAX)
+#define IOV_MAX 1024
+#endif
+
+/* 64-bit seek, truncate and sync of a file descriptor, which the Windows CRT names differently */
+static int64_t fd_seek(int fd, int64_t offset, int whence)
+{
+#if defined(AVS_WINDOWS)
+    return _lseeki64(fd, offset, whence);
+#else
+    return lseek(fd, offset, whence);
+#endif
+}
+
+static int fd_truncate(int fd, int64_t size)
+{
+#if defined(AVS_WINDOWS)
+    return _chsize_s(fd, size) ? -1 : 0;
+#else
+    return ftruncate(fd, size);
+#endif
+}
+
+static int fd_sync(int fd)
+{
+#if defined(AVS_WINDOWS)
+    return _commit(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
 #define MY_VERSION "Avs2YUV 0.30"
 #define AUTHORS "Writen by Loren Merritt, modified by BugMaster, Chikuzen\nand currently maintained by DJATOM"
 
 #define MAX_FH 10
-#define AVS_BUFSIZE (128*1024)
+
+#include "shm_ring.c"
+#include "latency.c"
+#include "file_sink.c"
 
 static volatile int b_ctrl_c = 0;
 
+/* the first Ctrl+C (or SIGTERM) stops after the current frame so that everything is
+ * flushed, checkpointed and reported, a second one exits right away */
 void sigintHandler(int sig_num)
 {
-    exit(0);
+    if(b_ctrl_c)
+        exit(0);
     b_ctrl_c = 1;
 }
 
@@ -83,71 +146,2622 @@ int64_t avs2yuv_mdate(void)
 #else
     struct timespec tb;
     clock_gettime(CLOCK_MONOTONIC, &tb);
-    return ((int64_t)tb.tv_sec * 1000 + (int64_t)tb.tv_nsec / 1000000) * 1000;
+    return (int64_t)tb.tv_sec * 1000000 + (int64_t)tb.tv_nsec / 1000;
 #endif
 }
 
-int main(int argc, const char* argv[])
+#define MAX_CPUS 1024
+
+/* parses a cpu list like "0-7,16-23"; returns the number of cpus set in 'cpus' or -1 */
+static int parse_cpu_list(const char *str, char *cpus)
 {
-    const char* infile = NULL;
-    const char* outfile[MAX_FH] = {NULL};
-    int y4m_headers[MAX_FH] = {0};
-    FILE* out_fh[10] = {NULL};
-    int out_fhs = 0;
-    int nostderr = 0;
-    int usage = 0;
-    int seek = 0;
-    int end = 0;
-    int slave = 0;
-    int raw_output = 0;
-    int interlaced = 0;
-    int tff = 0;
-    int input_depth = 8;
-    int input_width;
-    int input_height;
-    unsigned fps_num = 0;
-    unsigned fps_den = 0;
-    unsigned par_width = 0;
-    unsigned par_height = 0;
-    int i_frame = 0;
-    int64_t i_frame_total = 0;
-    int64_t i_start = 0;
-    #if defined(AVS_WINDOWS)
-    SetConsoleTitle("avs2yuv: preparing frameserver");
-    #endif
-    for(int i = 1; i < argc; i++) {
-        if(argv[i][0] == '-' && argv[i][1] != 0) {
-            if(!strcmp(argv[i], "-h"))
-                usage = 1;
-            else if(!strcmp(argv[i], "-nstdr"))
-                nostderr = 1;
-            else if(!strcmp(argv[i], "-o")) {
+    int count = 0;
+    memset(cpus, 0, MAX_CPUS);
+    while(*str) {
+        char *end;
+        long first = strtol(str, &end, 10);
+        if(end == str || first < 0 || first >= MAX_CPUS)
+            return -1;
+        long last = first;
+        str = end;
+        if(*str == '-') {
+            last = strtol(str + 1, &end, 10);
+            if(end == str + 1 || last < first || last >= MAX_CPUS)
+                return -1;
+            str = end;
+        }
+        for(long c = first; c <= last; c++)
+            if(!cpus[c]) {
+                cpus[c] = 1;
+                count++;
+            }
+        if(*str == ',')
+            str++;
+        else if(*str && *str != '\n')
+            return -1;
+        else
+            break;
+    }
+    return count;
+}
+
+static int numa_node_cpus(int node, char *cpus)
+{
+#if defined(__linux__)
+    char path[64];
+    char list[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *fh = fopen(path, "r");
+    if(!fh)
+        return -1;
+    int ok = fgets(list, sizeof(list), fh) != NULL;
+    fclose(fh);
+    return ok ? parse_cpu_list(list, cpus) : -1;
+#elif defined(AVS_WINDOWS)
+    ULONGLONG mask;
+    int count = 0;
+    if(node < 0 || node > 255 || !GetNumaNodeProcessorMask((UCHAR)node, &mask))
+        return -1;
+    memset(cpus, 0, MAX_CPUS);
+    for(int c = 0; c < 64; c++)
+        if(mask & ((ULONGLONG)1 << c)) {
+            cpus[c] = 1;
+            count++;
+        }
+    return count;
+#else
+    return -1;
+#endif
+}
+
+/* -affinity/-numa: the cpus the render threads are pinned to, set by pin_init() before any thread starts */
+static struct {
+    int count;              // 0 = no pinning
+#if defined(__linux__)
+    cpu_set_t set;
+    cpu_set_t all;          // the mask the process started with
+#elif defined(AVS_WINDOWS)
+    DWORD_PTR set;
+    DWORD_PTR all;
+#endif
+} pin;
+
+static int pin_init(const char *cpus, int count)
+{
+#if defined(__linux__)
+    CPU_ZERO(&pin.set);
+    for(int c = 0; c < MAX_CPUS && c < CPU_SETSIZE; c++)
+        if(cpus[c])
+            CPU_SET(c, &pin.set);
+    // try the mask once on this thread, so that a bad one fails here and not in every worker
+    if(sched_getaffinity(0, sizeof(pin.all), &pin.all) || sched_setaffinity(0, sizeof(pin.set), &pin.set))
+        return -1;
+    sched_setaffinity(0, sizeof(pin.all), &pin.all);
+#elif defined(AVS_WINDOWS)
+    DWORD_PTR system;
+    pin.set = 0;
+    for(int c = 0; c < (int)sizeof(pin.set) * 8; c++)
+        if(cpus[c])
+            pin.set |= (DWORD_PTR)1 << c;
+    if(!GetProcessAffinityMask(GetCurrentProcess(), &pin.all, &system) || !SetThreadAffinityMask(GetCurrentThread(), pin.set))
+        return -1;
+    SetThreadAffinityMask(GetCurrentThread(), pin.all);
+#else
+    return -1;
+#endif
+    pin.count = count;
+    return 0;
+}
+
+/* moves the calling thread onto the pinned cpus, or back onto all of them. Threads that render
+ * pin themselves before they open a script, so AviSynth's Prefetch threads inherit the cpus;
+ * writer, audio and compression threads unpin themselves in case they were started from one. */
+static void pin_thread(int pinned)
+{
+    if(!pin.count)
+        return;
+#if defined(__linux__)
+    sched_setaffinity(0, sizeof(cpu_set_t), pinned ? &pin.set : &pin.all);
+#elif defined(AVS_WINDOWS)
+    SetThreadAffinityMask(GetCurrentThread(), pinned ? pin.set : pin.all);
+#endif
+}
+
+static int online_cpus(void)
+{
+#if defined(AVS_WINDOWS)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#endif
+}
+
+#if defined(__linux__)
+/* a cgroup memory limit file in bytes; -1 for "max", or if it can't be read */
+static int64_t cgroup_read_limit(const char *path)
+{
+    char buf[64] = "";
+    FILE *fh = fopen(path, "r");
+    if(!fh)
+        return -1;
+    int ok = fgets(buf, sizeof(buf), fh) != NULL;
+    fclose(fh);
+    char *end;
+    long long limit = ok ? strtoll(buf, &end, 10) : 0;
+    return ok && end != buf && limit > 0 ? limit : -1;
+}
+#endif
+
+/* the memory limit of the cgroup we run in (or of the tightest one above it), in bytes;
+ * 0 if there is none or the limit is beyond the physical memory anyway */
+static int64_t cgroup_memory_limit(void)
+{
+#if defined(__linux__)
+    char line[4096], path[4200];
+    int64_t limit = -1;
+    FILE *fh = fopen("/proc/self/cgroup", "r");
+    while(fh && fgets(line, sizeof(line), fh)) {
+        line[strcspn(line, "\n")] = 0;
+        char *group = strchr(line, ':');
+        char *name = group ? strchr(group + 1, ':') : NULL;
+        if(!name)
+            continue;
+        *name++ = 0;
+        const char *file;
+        // cgroup v2 is "0::/path", v1 has a "memory" controller line
+        if(!strcmp(line, "0") && group[1] == 0) {
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s", name);
+            file = "memory.max";
+        } else if(strstr(group + 1, "memory")) {
+            snprintf(path, sizeof(path), "/sys/fs/cgroup/memory%s", name);
+            file = "memory.limit_in_bytes";
+        } else
+            continue;
+        for(;;) {
+            size_t len = strlen(path);
+            snprintf(path + len, sizeof(path) - len, "/%s", file);
+            int64_t l = cgroup_read_limit(path);
+            if(l > 0 && (limit < 0 || l < limit))
+                limit = l;
+            path[len] = 0;
+            char *up = strrchr(path, '/');
+            if(!up || up - path < (int)strlen("/sys/fs/cgroup"))
+                break;
+            *up = 0;
+        }
+    }
+    if(fh)
+        fclose(fh);
+    int64_t ram = (int64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    return limit > 0 && (ram <= 0 || limit < ram) ? limit : 0;
+#else
+    return 0;
+#endif
+}
+
+/* peak resident set size of the process in KiB, 0 where it isn't known */
+static int64_t peak_rss_kib(void)
+{
+#if defined(AVS_POSIX)
+    struct rusage ru;
+    if(getrusage(RUSAGE_SELF, &ru))
+        return 0;
+#if defined(AVS_MACOS)
+    return ru.ru_maxrss / 1024; // bytes there
+#else
+    return ru.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+/* how frames of the clip become output frames: as they are, two fields woven into one
+ * frame, or one frame split into its two fields (-fields) */
+enum { FIELDS_KEEP, FIELDS_WEAVE, FIELDS_SEPARATE };
+
+/* what the outputs are handed for one output frame */
+typedef struct {
+    AVS_VideoFrame *frame;
+    AVS_VideoFrame *bottom;     // FIELDS_WEAVE: the bottom field, 'frame' being the top one
+    int field;                  // FIELDS_SEPARATE: 1 for the top, 2 for the bottom field of 'frame'
+} frame_t;
+
+static frame_t frame_ref(avs_hnd_t *avs_h, frame_t f)
+{
+    f.frame = avs_h->func.avs_copy_video_frame(f.frame);
+    if(f.bottom)
+        f.bottom = avs_h->func.avs_copy_video_frame(f.bottom);
+    return f;
+}
+
+static void frame_release(avs_hnd_t *avs_h, frame_t f)
+{
+    if(f.frame)
+        avs_h->func.avs_release_video_frame(f.frame);
+    if(f.bottom)
+        avs_h->func.avs_release_video_frame(f.bottom);
+}
+
+/* where the rows of one plane of an output frame are: row y is row y / n of source y % n,
+ * so woven fields are interleaved as they are read and no woven copy is ever made */
+typedef struct {
+    const BYTE *data[2];
+    int pitch[2];
+    int n;
+} plane_rows_t;
+
+static inline const BYTE *plane_row(const plane_rows_t *r, int y)
+{
+    int k = r->n > 1 ? y & 1 : 0;
+    return r->data[k] + (ptrdiff_t)(y / r->n) * r->pitch[k];
+}
+
+static void frame_rows(avs_hnd_t *avs_h, frame_t f, int plane_id, plane_rows_t *r)
+{
+    r->n = f.bottom ? 2 : 1;
+    for(int k = 0; k < r->n; k++) {
+        AVS_VideoFrame *src = k ? f.bottom : f.frame;
+        r->data[k] = avs_h->func.avs_get_read_ptr_p(src, plane_id);
+        r->pitch[k] = avs_h->func.avs_get_pitch_p(src, plane_id);
+    }
+    if(f.field) {
+        r->data[0] += (f.field - 1) * r->pitch[0];
+        r->pitch[0] *= 2;
+    }
+}
+
+/* bounded queue of frame references handed from one thread to another;
+ * 'pending' counts frames pushed but not yet released by the consumer */
+typedef struct {
+    frame_t *frames;
+    int size;
+    int head;
+    int count;
+    int pending;
+    int closed;
+    int aborted;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} frame_queue_t;
+
+static int frame_queue_init(frame_queue_t *q, int size)
+{
+    q->frames = malloc(size * sizeof(frame_t));
+    if(!q->frames)
+        return -1;
+    q->size = size;
+    q->head = q->count = q->pending = 0;
+    q->closed = q->aborted = 0;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    return 0;
+}
+
+/* blocks while the consumer holds 'size' frames; fails once the consumer has given up */
+static int frame_queue_push(frame_queue_t *q, frame_t f)
+{
+    pthread_mutex_lock(&q->mutex);
+    while(q->pending >= q->size && !q->aborted)
+        pthread_cond_wait(&q->cond, &q->mutex);
+    int ret = q->aborted ? -1 : 0;
+    if(!ret) {
+        q->frames[(q->head + q->count) % q->size] = f;
+        q->count++;
+        q->pending++;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return ret;
+}
+
+/* returns the next frame in order, or one without a frame once the producer has closed or the queue was aborted */
+static frame_t frame_queue_pop(frame_queue_t *q)
+{
+    frame_t f = {NULL};
+    pthread_mutex_lock(&q->mutex);
+    while(!q->count && !q->closed && !q->aborted)
+        pthread_cond_wait(&q->cond, &q->mutex);
+    if(q->count && !q->aborted) {
+        f = q->frames[q->head];
+        q->head = (q->head + 1) % q->size;
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return f;
+}
+
+/* the consumer is done with a popped frame */
+static void frame_queue_release(frame_queue_t *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->pending--;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/* waits until the consumer has released every pushed frame; fails if it gave up */
+static int frame_queue_wait_idle(frame_queue_t *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    while(q->pending && !q->aborted)
+        pthread_cond_wait(&q->cond, &q->mutex);
+    int ret = q->aborted ? -1 : 0;
+    pthread_mutex_unlock(&q->mutex);
+    return ret;
+}
+
+static void frame_queue_close(frame_queue_t *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static void frame_queue_abort(frame_queue_t *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    q->aborted = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/* releases whatever is still queued; the queue must have no other users left */
+static void frame_queue_free(frame_queue_t *q, avs_hnd_t *avs_h)
+{
+    if(!q->frames)
+        return;
+    for(; q->count; q->count--) {
+        frame_release(avs_h, q->frames[q->head]);
+        q->head = (q->head + 1) % q->size;
+    }
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->mutex);
+    free(q->frames);
+    q->frames = NULL;
+}
+
+#include "convert.c"
+
+typedef struct {
+    avs_hnd_t *avs_h;
+    int planes;
+    int plane_id[4];
+    int row_size[4];
+    int height[4];
+    int64_t frame_size;
+    int sample_size;        // bytes per sample, 2 for the high bit depth hack
+    int max_iov;            // iovecs needed for a frame written row by row, plus its header
+    int converted;          // frames go through conv on the way out, the sizes above are those of the output
+    convert_t conv;
+    int fields;             // FIELDS_*, how render_frame() makes output frames of the clip
+} frame_layout_t;
+
+/* copies a frame into contiguous memory, dropping the pitch padding; woven fields go to
+ * every other row each */
+static void pack_frame(const frame_layout_t *layout, frame_t f, BYTE *dst)
+{
+    avs_hnd_t *avs_h = layout->avs_h;
+    if(layout->converted) {
+        convert_frame(&layout->conv, avs_h, f, dst);
+        return;
+    }
+    for(int p = 0; p < layout->planes; p++) {
+        plane_rows_t r;
+        frame_rows(avs_h, f, layout->plane_id[p], &r);
+        for(int k = 0; k < r.n; k++)
+            avs_h->func.avs_bit_blt(avs_h->env, dst + k * layout->row_size[p], layout->row_size[p] * r.n, r.data[k],
+                                    r.pitch[k], layout->row_size[p], layout->height[p] / r.n);
+        dst += (size_t)layout->row_size[p] * layout->height[p];
+    }
+}
+
+#include "avz.c"
+#include "stats.c"
+#include "hash.c"
+
+typedef struct {
+    const char *name;
+    const char *name_template; // with -ranges or -segment, a name holding %d gets one file per range or segment
+    char file_name[4096];
+    int file_first;         // frames and size of the current file, for the -manifest
+    int file_last;
+    int64_t file_start;
+    int fd;
+    int y4m_header;
+    int lag;
+    int splice;             // requested with -splice, only honoured for pipes
+    int slots;              // ring size for shm:NAME outputs
+    shm_ring_t *ring;       // set for shm:NAME outputs, which have no fd
+    int io;                 // -io mode, only honoured for regular files
+    int64_t expect;         // final size if known, reserved up front by -io direct and mmap
+    file_sink_t *sink;
+    avz_t *avz;             // set for avz:PATH outputs once they are started
+    int encoders;           // compression threads for avz:PATH outputs, 0 = online cpus
+    latency_t write_latency;
+    int pipe_size;          // set when frames are vmsplice'd, see output_retire()
+    int64_t bytes;
+    int frames;             // frames written in full, read by -checkpoint while writer threads run
+    int resumed;            // reopened by -resume, the header is already there
+    struct iovec *iov;
+    BYTE *packed;           // the converted frame, when frames are converted
+    struct {
+        frame_t frame;
+        int64_t end;
+    } *held;                // frames whose pages may still sit in the pipe
+    int held_size;
+    int held_head;
+    int held_count;
+} output_t;
+
+/* the file behind an output name, without an avz: prefix */
+static const char *output_path(const output_t *out)
+{
+    return strncmp(out->name, "avz:", 4) ? out->name : out->name + 4;
+}
+
+static int output_open(output_t *out, const frame_layout_t *layout)
+{
+    if(!strncmp(out->name, "shm:", 4)) {
+        out->ring = calloc(1, sizeof(shm_ring_t));
+        if(!out->ring || shm_ring_create(out->ring, out->name + 4, out->slots, layout->frame_size)) {
+            fprintf(stderr, "Error: failed to create shared memory ring \"%s\".\n", out->name + 4);
+            free(out->ring);
+            out->ring = NULL;
+            return -1;
+        }
+        return 0;
+    }
+    if(!strcmp(out->name, "-")) {
+        int dupout = dup(fileno(stdout));
+        fclose(stdout);
+        #if defined(AVS_WINDOWS)
+        _setmode(dupout, _O_BINARY);
+        #endif
+        out->fd = dupout;
+    } else if(out->fd < 0)
+        out->fd = open(output_path(out), (out->io == IO_MMAP ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC | O_BINARY, 0666); // already set for -server jobs
+    if(out->fd < 0) {
+        fprintf(stderr, "Error: failed to create/open \"%s\".\n", out->name);
+        return -1;
+    }
+    out->iov = malloc(layout->max_iov * sizeof(struct iovec));
+    if(!out->iov || (layout->converted && !(out->packed = malloc(layout->frame_size))))
+        return -1;
+    if(out->io && strncmp(out->name, "avz:", 4)) {
+        struct stat st;
+        if(fstat(out->fd, &st) || !S_ISREG(st.st_mode) || fd_seek(out->fd, 0, SEEK_CUR) != 0)
+            fprintf(stderr, "Warning: -io only applies to new regular files, \"%s\" is written as usual.\n", out->name);
+        else if(!(out->sink = malloc(sizeof(file_sink_t))) || file_sink_open(out->sink, out->fd, out->io, out->expect)) {
+            fprintf(stderr, "Error: failed to set up -io for \"%s\".\n", out->name);
+            free(out->sink);
+            out->sink = NULL;
+            return -1;
+        }
+    }
+#if defined(AVS_SPLICE)
+    struct stat st;
+    if(out->splice && !fstat(out->fd, &st) && S_ISFIFO(st.st_mode)) {
+        fcntl(out->fd, F_SETPIPE_SZ, 1024 * 1024);
+        out->pipe_size = fcntl(out->fd, F_GETPIPE_SZ);
+        if(out->pipe_size > 0) {
+            out->held_size = out->pipe_size / layout->frame_size + 2;
+            out->held = malloc(out->held_size * sizeof(*out->held));
+        }
+        if(!out->held)
+            out->pipe_size = 0;
+    }
+#endif
+    return 0;
+}
+
+/* writes all of iov, continuing after short writes; returns the number of bytes written.
+ * Only memory that stays untouched until output_retire() lets go of it may be vmsplice'd. */
+static int64_t output_write_iov(output_t *out, struct iovec *iov, int iovcnt, int gift)
+{
+    int64_t total = 0;
+    if(out->sink)
+        return file_sink_write(out->sink, iov, iovcnt);
+    while(iovcnt > 0) {
+#if defined(AVS_SPLICE)
+        ssize_t ret = gift && out->pipe_size ? vmsplice(out->fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt, 0)
+                                             : writev(out->fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+        if(ret < 0 && gift && out->pipe_size && !total && (errno == EINVAL || errno == ENOSYS)) {
+            out->pipe_size = 0; // no vmsplice for this pipe, fall back to plain writes
+            continue;
+        }
+#elif defined(AVS_POSIX)
+        ssize_t ret = writev(out->fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+#else
+        ssize_t ret = write(out->fd, iov->iov_base, iov->iov_len);
+#endif
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            break;
+        total += ret;
+        for(; iovcnt > 0 && (size_t)ret >= iov->iov_len; iov++, iovcnt--)
+            ret -= iov->iov_len;
+        if(iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return total;
+}
+
+/* shm rings describe the stream in their own header, so headers written here are dropped for them */
+static int64_t output_write(output_t *out, const void *data, size_t size)
+{
+    if(out->ring)
+        return size;
+    struct iovec iov = {(void*)data, size};
+    int64_t wrote = output_write_iov(out, &iov, 1, 0);
+    out->bytes += wrote;
+    return wrote;
+}
+
+/* vmsplice'd pages stay referenced by the pipe until the reader consumes them, so a frame
+ * is only released once a full pipe worth of data has been pushed after it; f == NULL waits
+ * for the reader to drain the pipe and releases everything */
+static void output_retire(output_t *out, const frame_layout_t *layout, const frame_t *f)
+{
+#if defined(AVS_SPLICE)
+    if(!f) {
+        int unread;
+        struct pollfd pfd = {out->fd, POLLOUT, 0};
+        while(!ioctl(out->fd, FIONREAD, &unread) && unread > 0 && poll(&pfd, 1, 0) >= 0 && !(pfd.revents & POLLERR))
+            usleep(1000);
+    }
+#endif
+    while(out->held_count) {
+        int i = out->held_head;
+        if(f && out->bytes - out->held[i].end < out->pipe_size)
+            break;
+        frame_release(layout->avs_h, out->held[i].frame);
+        out->held_head = (i + 1) % out->held_size;
+        out->held_count--;
+    }
+    if(f) {
+        int i = (out->held_head + out->held_count++) % out->held_size;
+        out->held[i].frame = frame_ref(layout->avs_h, *f);
+        out->held[i].end = out->bytes;
+    }
+}
+
+/* publishes a frame into the ring of a shm:NAME output, packing f or copying already packed data */
+static int64_t ring_write(output_t *out, const frame_layout_t *layout, const frame_t *f, const BYTE *data)
+{
+    shm_slot_header_t *slot = shm_ring_acquire(out->ring, &b_ctrl_c);
+    if(!slot)
+        return 0;
+    if(f)
+        pack_frame(layout, *f, shm_slot_data(slot));
+    else
+        memcpy(shm_slot_data(slot), data, layout->frame_size);
+    shm_ring_publish(out->ring, out->ring->hdr->write_seq, 0, layout->frame_size);
+    out->bytes += layout->frame_size;
+    return layout->frame_size;
+}
+
+/* writes one frame with a single gathered write: whole planes when they are contiguous,
+ * one iovec per row otherwise; returns the number of bytes written (excluding the y4m frame header) */
+static int64_t write_frame(output_t *out, const frame_layout_t *layout, frame_t f)
+{
+    int64_t start = avs2yuv_mdate();
+    int64_t wrote;
+    if(out->ring)
+        wrote = ring_write(out, layout, &f, NULL);
+    else if(out->avz) {
+        wrote = avz_write(out->avz, f) ? 0 : layout->frame_size;
+        out->bytes = out->file_start + out->avz->offset;
+    } else {
+        struct iovec *iov = out->iov;
+        int n = 0;
+        int gift = out->pipe_size && !layout->converted;
+        wrote = 0;
+        if(out->y4m_header) {
+            iov[n].iov_base = "FRAME\n";
+            iov[n++].iov_len = 6;
+        }
+        if(gift && n) {
+            // only the planes are vmsplice'd, the marker is copied like the other small writes
+            wrote = output_write_iov(out, iov, n, 0);
+            n = 0;
+        }
+        if(layout->converted) {
+            pack_frame(layout, f, out->packed);
+            iov[n].iov_base = out->packed;
+            iov[n++].iov_len = layout->frame_size;
+        }
+        for(int p = 0; p < layout->planes && !layout->converted; p++) {
+            plane_rows_t r;
+            frame_rows(layout->avs_h, f, layout->plane_id[p], &r);
+            if(r.n == 1 && r.pitch[0] == layout->row_size[p]) {
+                iov[n].iov_base = (void*)r.data[0];
+                iov[n++].iov_len = (size_t)layout->row_size[p] * layout->height[p];
+                continue;
+            }
+            for(int y = 0; y < layout->height[p]; y++) {
+                iov[n].iov_base = (void*)plane_row(&r, y);
+                iov[n++].iov_len = layout->row_size[p];
+            }
+        }
+        wrote += output_write_iov(out, iov, n, gift);
+        out->bytes += wrote;
+        if(gift && out->pipe_size)
+            output_retire(out, layout, &f);
+        if(out->y4m_header)
+            wrote -= 6;
+    }
+    if(wrote == layout->frame_size)
+        __atomic_store_n(&out->frames, out->frames + 1, __ATOMIC_RELEASE);
+    latency_add(&out->write_latency, avs2yuv_mdate() - start, -1);
+    return wrote;
+}
+
+/* writes a frame packed by pack_frame(); the buffer may be reused right away, so it is always copied */
+static int64_t write_packed(output_t *out, const frame_layout_t *layout, const BYTE *data)
+{
+    int64_t start = avs2yuv_mdate();
+    int64_t wrote;
+    if(out->ring)
+        wrote = ring_write(out, layout, NULL, data);
+    else if(out->avz)
+        wrote = 0; // avz: outputs compress straight from the frames, see write_frame()
+    else {
+        struct iovec iov[2];
+        int n = 0;
+        if(out->y4m_header) {
+            iov[n].iov_base = "FRAME\n";
+            iov[n++].iov_len = 6;
+        }
+        iov[n].iov_base = (void*)data;
+        iov[n++].iov_len = layout->frame_size;
+        wrote = output_write_iov(out, iov, n, 0);
+        out->bytes += wrote;
+        if(out->y4m_header)
+            wrote -= 6;
+    }
+    if(wrote == layout->frame_size)
+        __atomic_store_n(&out->frames, out->frames + 1, __ATOMIC_RELEASE);
+    latency_add(&out->write_latency, avs2yuv_mdate() - start, -1);
+    return wrote;
+}
+
+/* writes out what an -io sink or an avz: encoder still holds */
+static int output_finish(output_t *out)
+{
+    int err = 0;
+    if(out->avz) {
+        err = avz_finish(out->avz);
+        out->bytes = out->file_start + out->avz->offset;
+        free(out->avz);
+        out->avz = NULL;
+    }
+    if(out->sink) {
+        err |= file_sink_finish(out->sink);
+        free(out->sink);
+        out->sink = NULL;
+    }
+    if(err)
+        fprintf(stderr, "Error: failed to write to \"%s\".\n", out->name);
+    return err;
+}
+
+/* 'complete' is set when the stream ended normally; only then does a ring wait for its reader */
+static void output_close(output_t *out, const frame_layout_t *layout, int complete)
+{
+    output_finish(out);
+    if(out->ring) {
+        uint64_t unread = complete ? shm_ring_finish(out->ring, &b_ctrl_c) : 0;
+        if(unread && !b_ctrl_c)
+            fprintf(stderr, "Warning: no reader took the last %"PRIu64" frames of \"%s\".\n", unread, out->name);
+        shm_ring_close(out->ring);
+        shm_ring_unlink(out->ring);
+        free(out->ring);
+        out->ring = NULL;
+    }
+    if(out->held) {
+        output_retire(out, layout, NULL);
+        free(out->held);
+        out->held = NULL;
+    }
+    free(out->iov);
+    out->iov = NULL;
+    free(out->packed);
+    out->packed = NULL;
+    if(out->fd >= 0)
+        close(out->fd);
+    out->fd = -1;
+}
+
+/* opens the output and writes what goes before the first frame: the y4m header, or the
+ * stream description for a ring */
+static int output_start(output_t *out, const frame_layout_t *layout, const char *header, int header_len, const shm_ring_header_t *desc)
+{
+    if(output_open(out, layout))
+        return -1;
+    if(!strncmp(out->name, "avz:", 4)) {
+        // the header goes into the container, whether or not -raw was given
+        out->avz = malloc(sizeof(avz_t));
+        if(!out->avz || avz_open(out->avz, out->fd, layout, header, header_len, out->encoders > 0 ? out->encoders : online_cpus())) {
+            fprintf(stderr, "Error: failed to start compressing \"%s\".\n", out->name);
+            if(out->avz)
+                avz_free(out->avz);
+            free(out->avz);
+            out->avz = NULL;
+            return -1;
+        }
+        return 0;
+    }
+    if(out->ring)
+        shm_ring_describe(out->ring, desc);
+    if(out->y4m_header && !out->resumed && output_write(out, header, header_len) != header_len) {
+        fprintf(stderr, "Error: failed to write to \"%s\".\n", out->name);
+        return -1;
+    }
+    return 0;
+}
+
+/* 1 if the name holds a single %d conversion (a zero-padded width is allowed), 0 if it
+ * has none and -1 if it has anything else; "%%" stands for a literal percent sign */
+static int name_is_template(const char *name)
+{
+    int found = 0;
+    for(const char *p = strchr(name, '%'); p; p = strchr(p, '%')) {
+        if(*++p == '%') {
+            p++;
+            continue;
+        }
+        while(*p >= '0' && *p <= '9')
+            p++;
+        if(*p != 'd' || found++)
+            return -1;
+    }
+    return found;
+}
+
+/* opens the file of a templated output that starts with frame 'first' */
+static int output_next_file(output_t *out, const frame_layout_t *layout, int first, const char *header, int header_len, const shm_ring_header_t *desc)
+{
+    snprintf(out->file_name, sizeof(out->file_name), out->name_template, first);
+    out->name = out->file_name;
+    out->file_first = first;
+    out->file_last = first;
+    out->file_start = out->bytes;
+    return output_start(out, layout, header, header_len, desc);
+}
+
+/* closes the current file of a templated output and lists it in the manifest, so that a
+ * line only shows up there once its file is complete */
+static int output_end_file(output_t *out, const frame_layout_t *layout, FILE *manifest)
+{
+    if(output_finish(out))
+        return -1;
+    output_close(out, layout, 1);
+    if(!manifest)
+        return 0;
+    fprintf(manifest, "%s\t%d\t%d\t%"PRId64"\n", output_path(out), out->file_first, out->file_last, out->bytes - out->file_start);
+    if(fflush(manifest)) {
+        fprintf(stderr, "Error: failed to write to the manifest.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* imports the script into an existing environment, replacing the clip it held */
+static int import_script(avs_hnd_t *avs_h, const char *infile, const AVS_VideoInfo **inf)
+{
+    if(avs_h->clip)
+        avs_h->func.avs_release_clip(avs_h->clip);
+    avs_h->clip = NULL;
+    AVS_Value arg = avs_new_value_string(infile);
+    AVS_Value res = avs_h->func.avs_invoke(avs_h->env, "Import", arg, NULL);
+    if(avs_is_error(res)) {
+        fprintf(stderr, "Error: %s.\n", avs_as_string(res));
+        return -1;
+    }
+    if(!avs_is_clip(res)) {
+        fprintf(stderr, "Error: \"%s\" didn't return a video clip.\n", infile);
+        avs_h->func.avs_release_value(res);
+        return -1;
+    }
+    avs_h->clip = avs_h->func.avs_take_clip(res, avs_h->env);
+    avs_h->func.avs_release_value(res);
+    *inf = avs_h->func.avs_get_video_info(avs_h->clip);
+    if(!avs_has_video(*inf)) {
+        fprintf(stderr, "Error: \"%s\" has no video data.\n", infile);
+        return -1;
+    }
+    if(!avs_h->func.avs_component_size(*inf)) {
+        fprintf(stderr, "Error: this program only works with Avisynth+.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* creates a script environment on an already loaded library and imports the script into it */
+static int open_script(avs_hnd_t *avs_h, const char *infile, const AVS_VideoInfo **inf)
+{
+    avs_h->env = avs_h->func.avs_create_script_environment(AVISYNTH_INTERFACE_VERSION);
+    if(avs_h->func.avs_get_error) {
+        const char *error = avs_h->func.avs_get_error(avs_h->env);
+        if(error) {
+            fprintf(stderr, "Error: %s.\n", error);
+            return -1;
+        }
+    }
+    return import_script(avs_h, infile, inf);
+}
+
+/* field-based clips are woven into frames unless 'separate' (-fields) asks for fields,
+ * which frame-based clips are then split into; either way it happens on the way out,
+ * without a Weave or SeparateFields filter in the script */
+static int field_mode(const AVS_VideoInfo *inf, int separate)
+{
+    if(avs_is_field_based(inf))
+        return separate ? FIELDS_KEEP : FIELDS_WEAVE;
+    return separate ? FIELDS_SEPARATE : FIELDS_KEEP;
+}
+
+/* the clip as the outputs see it in the given field mode, filled into vi if it differs */
+static const AVS_VideoInfo *output_info(const AVS_VideoInfo *inf, int fields, AVS_VideoInfo *vi)
+{
+    if(fields == FIELDS_KEEP)
+        return inf;
+    *vi = *inf;
+    if(fields == FIELDS_WEAVE) {
+        vi->height *= 2;
+        vi->num_frames /= 2; // a lone field at the end is dropped
+        if(vi->fps_numerator & 1)
+            vi->fps_denominator *= 2;
+        else
+            vi->fps_numerator /= 2;
+        vi->image_type &= ~AVS_IT_FIELDBASED;
+    } else {
+        vi->height /= 2;
+        vi->num_frames *= 2;
+        if(vi->fps_denominator & 1)
+            vi->fps_numerator *= 2;
+        else
+            vi->fps_denominator /= 2;
+    }
+    return vi;
+}
+
+/* releases the clip and environment but keeps the library loaded */
+static void close_script(avs_hnd_t *avs_h)
+{
+    if(avs_h->clip)
+        avs_h->func.avs_release_clip(avs_h->clip);
+    avs_h->clip = NULL;
+    if(avs_h->env && avs_h->func.avs_delete_script_environment)
+        avs_h->func.avs_delete_script_environment(avs_h->env);
+    avs_h->env = NULL;
+}
+
+/* true if the clip carries the high bit depth hack: an 8-bit clip holding 16-bit samples,
+ * interleaved (twice the width) or with -stacked, MSB rows over LSB rows (twice the height) */
+static int clip_is_hack(avs_hnd_t *avs_h, const AVS_VideoInfo *inf, int input_depth)
+{
+    return input_depth > 8 && (avs_h->func.avs_is_yv12(inf) || avs_h->func.avs_is_yv16(inf) || avs_h->func.avs_is_yv24(inf) ||
+                               avs_h->func.avs_is_y8(inf)); //ignore native hbd cs
+}
+
+/* picks the y4m colorspace tag of the output, left empty if there is none, how its planes are written
+ * and the conversion on the way there; with 'alpha' set, all of that for the separate alpha stream.
+ * Returns why fmt can't be written from this clip, NULL if it can. */
+static const char *clip_format(avs_hnd_t *avs_h, const AVS_VideoInfo *inf, int input_depth, const output_format_t *fmt, int raw, int alpha,
+                               char *csp_type, frame_layout_t *layout)
+{
+    int chroma_h_shift = 0;
+    int chroma_v_shift = 0;
+    int size = avs_h->func.avs_component_size(inf);
+    int hack = clip_is_hack(avs_h, inf, input_depth);
+    int depth = hack ? input_depth : avs_h->func.avs_bits_per_component(inf);
+    int bits = fmt->bits ? fmt->bits : depth;
+    int pack = alpha ? PACK_PLANAR : fmt->pack; // the alpha stream takes the depth of a packed layout, not the layout
+    int has_alpha = avs_h->func.avs_is_yuva(inf) || avs_h->func.avs_is_planar_rgba(inf);
+    int rgb = avs_h->func.avs_is_planar_rgb(inf) || avs_h->func.avs_is_planar_rgba(inf);
+    const char *family = NULL;
+    if(alpha)
+        family = "mono";
+    else if(rgb)
+        family = "rgb"; // no y4m tag, -raw only
+    else if(avs_h->func.avs_is_y(inf))
+        family = "mono";
+    else if(avs_h->func.avs_is_420(inf)) {
+        chroma_h_shift = 1;
+        chroma_v_shift = 1;
+        family = "420";
+    } else if(avs_h->func.avs_is_422(inf)) {
+        chroma_h_shift = 1;
+        family = "422";
+    } else if(avs_h->func.avs_is_444(inf))
+        family = "444";
+    if((alpha || fmt->alpha_plane) && !has_alpha)
+        return "the clip has no alpha plane";
+    if(fmt->alpha_plane && !alpha && (!raw || fmt->pack))
+        return "-rawalpha needs -raw and the planar layout";
+    if(fmt->stacked && !hack)
+        return "-stacked needs the -depth hack on an 8-bit YUV clip";
+    if((fmt->bits || fmt->pack) && !family)
+        return "-bits and -pack only convert YUV, RGB and Y clips";
+    if(fmt->limited && size != 4)
+        return "-range limited only applies to float clips";
+    if(size == 4 && !fmt->bits && !fmt->pack) {
+        if(!raw)
+            return "y4m has no float tag, quantize the clip with -bits or write it as it is with -raw";
+        bits = 0; // written as it is, no tag
+    }
+    if(fmt->pack == PACK_P010 || fmt->pack == PACK_P016) {
+        if(!alpha && !avs_h->func.avs_is_420(inf))
+            return "-pack p010 and p016 need a 4:2:0 clip";
+        bits = fmt->pack == PACK_P010 ? 10 : 16;
+    } else if(fmt->pack == PACK_V210) {
+        if(!alpha && !avs_h->func.avs_is_422(inf))
+            return "-pack v210 needs a 4:2:2 clip";
+        bits = 10;
+    }
+    if(pack && !raw)
+        return "-pack layouts have no y4m tag, they need -raw";
+    if(family && !strcmp(family, "mono")) {
+        if(!raw && bits > 8 && bits < 16) {
+            // y4m only knows 8 and 16-bit mono, so the samples are shifted up to match the tag
+            fprintf(stderr, "Warning: output bit-depth is forced to 16 (was %d)!\n", bits);
+            bits = 16;
+        }
+        if(bits)
+            sprintf(csp_type, bits == 16 ? "Cmono16 XYSCSS=Cmono16" : "Cmono");
+    } else if(family && !strcmp(family, "rgb"))
+        ;
+    else if(family && bits > 8)
+        sprintf(csp_type, "C%sp%d XYSCSS=C%sp%d", family, bits, family, bits);
+    else if(family && bits)
+        sprintf(csp_type, "C%s", strcmp(family, "420") ? family : "420mpeg2");
+    // planar RGB goes out as G, B, R like gbrp; chroma planes are 1 and 2, alpha is never subsampled
+    static const int yuv_planes[] = {AVS_PLANAR_Y, AVS_PLANAR_U, AVS_PLANAR_V};
+    static const int rgb_planes[] = {AVS_PLANAR_G, AVS_PLANAR_B, AVS_PLANAR_R};
+    int planes = alpha ? 1 : avs_h->func.avs_num_components(inf) < 3 ? avs_h->func.avs_num_components(inf) : 3;
+    int chroma[4] = {0};
+    for(int p = 0; p < planes; p++) {
+        layout->plane_id[p] = alpha ? AVS_PLANAR_A : rgb ? rgb_planes[p] : yuv_planes[p];
+        chroma[p] = p && !rgb && !alpha;
+    }
+    if(fmt->alpha_plane && !alpha)
+        layout->plane_id[planes++] = AVS_PLANAR_A;
+    layout->avs_h = avs_h;
+    layout->planes = planes;
+    layout->max_iov = 1;
+    layout->sample_size = hack && size == 1 ? 2 : size;
+    layout->converted = family && bits && (fmt->stacked || pack || bits != depth);
+    if(layout->converted) {
+        convert_t *c = &layout->conv;
+        int width = hack && !fmt->stacked ? inf->width / 2 : inf->width;
+        int height = fmt->stacked ? inf->height / 2 : inf->height;
+        c->planes = planes;
+        for(int p = 0; p < c->planes; p++) {
+            c->plane_id[p] = layout->plane_id[p];
+            c->width[p] = width >> (chroma[p] ? chroma_h_shift : 0);
+            c->height[p] = height >> (chroma[p] ? chroma_v_shift : 0);
+        }
+        c->src_bytes = hack && !fmt->stacked ? 2 : size;
+        c->stacked = fmt->stacked;
+        c->dst_bytes = bits > 8 || pack ? 2 : 1;
+        c->src_bits = size == 4 ? bits : depth; // float is quantized straight to the output depth
+        c->dst_bits = bits;
+        for(int p = 0; p < c->planes && size == 4; p++) {
+            int limited = fmt->limited && c->plane_id[p] != AVS_PLANAR_A; // alpha always uses the full range
+            float unit = 1 << (bits - 8);
+            c->scale[p] = limited ? (chroma[p] ? 224 : 219) * unit : (1 << bits) - 1;
+            c->offset[p] = limited ? (chroma[p] ? 128 : 16) * unit : chroma[p] ? 1 << (bits - 1) : 0;
+        }
+        c->pack = pack;
+        c->dither = fmt->dither;
+        convert_init(c);
+        layout->sample_size = c->dst_bytes;
+        layout->max_iov = 2;
+        if(pack == PACK_V210) {
+            layout->planes = 1;
+            layout->row_size[0] = convert_v210_row_size(width);
+            layout->height[0] = height;
+        } else if(pack) {
+            // P010 and P016: Y, then U and V interleaved
+            layout->planes = 2;
+            layout->row_size[0] = width * 2;
+            layout->height[0] = height;
+            layout->row_size[1] = c->width[1] * 4;
+            layout->height[1] = c->height[1];
+        } else
+            for(int p = 0; p < layout->planes; p++) {
+                layout->row_size[p] = c->width[p] * c->dst_bytes;
+                layout->height[p] = c->height[p];
+            }
+        for(int p = 0; p < layout->planes; p++)
+            layout->frame_size += (int64_t)layout->row_size[p] * layout->height[p];
+        return NULL;
+    }
+    for(int p = 0; p < layout->planes; p++) {
+        layout->row_size[p] = (inf->width * size) >> (chroma[p] ? chroma_h_shift : 0);
+        layout->height[p] = inf->height >> (chroma[p] ? chroma_v_shift : 0);
+        layout->frame_size += (int64_t)layout->row_size[p] * layout->height[p];
+        layout->max_iov += layout->height[p];
+    }
+    return NULL;
+}
+
+/* every frame is rendered through here, so its latency ends up in the -report histogram */
+static latency_t render_latency;
+static pthread_mutex_t render_latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* gets output frame frm of the clip, which is made of two clip frames when 'fields' weaves
+ * or takes half of one when it separates; check avs_clip_get_error() afterwards */
+static frame_t render_frame(avs_hnd_t *avs_h, int fields, int frm)
+{
+    int64_t start = avs2yuv_mdate();
+    int tff = avs_is_tff(avs_h->func.avs_get_video_info(avs_h->clip));
+    frame_t f = {NULL};
+    if(fields == FIELDS_WEAVE) {
+        // the field that comes first in time is the top one in tff clips
+        f.frame = avs_h->func.avs_get_frame(avs_h->clip, 2 * frm + !tff);
+        if(!avs_h->func.avs_clip_get_error(avs_h->clip))
+            f.bottom = avs_h->func.avs_get_frame(avs_h->clip, 2 * frm + tff);
+    } else if(fields == FIELDS_SEPARATE) {
+        f.frame = avs_h->func.avs_get_frame(avs_h->clip, frm / 2);
+        f.field = 1 + ((frm & 1) ^ !tff);
+    } else
+        f.frame = avs_h->func.avs_get_frame(avs_h->clip, frm);
+    int64_t us = avs2yuv_mdate() - start;
+    pthread_mutex_lock(&render_latency_mutex);
+    latency_add(&render_latency, us, frm);
+    pthread_mutex_unlock(&render_latency_mutex);
+    return f;
+}
+
+/* true if the script already set up AviSynth+ MT itself */
+static int script_has_prefetch(avs_hnd_t *avs_h, const char *infile)
+{
+    if(avs_h->func.avs_get_env_property)
+        return avs_h->func.avs_get_env_property(avs_h->env, AVS_AEP_FILTERCHAIN_THREADS) > 1;
+    // older cores can't tell, so look for a Prefetch call outside of comments
+    FILE *fh = fopen(infile, "r");
+    char line[1024];
+    int found = 0;
+    if(!fh)
+        return 0;
+    while(!found && fgets(line, sizeof(line), fh)) {
+        char *comment = strchr(line, '#');
+        if(comment)
+            *comment = 0;
+        for(char *c = line; *c && !found; c++)
+            found = !strncasecmp(c, "prefetch", 8);
+    }
+    fclose(fh);
+    return found;
+}
+
+/* wraps the clip in Prefetch(threads); returns 1 if done, 0 if the script already does it */
+static int set_threads(avs_hnd_t *avs_h, const char *infile, const AVS_VideoInfo **inf, int threads)
+{
+    if(script_has_prefetch(avs_h, infile))
+        return 0;
+    AVS_Value args[2];
+    avs_h->func.avs_set_to_clip(&args[0], avs_h->clip);
+    args[1] = avs_new_value_int(threads);
+    AVS_Value tmp = avs_h->func.avs_invoke(avs_h->env, "Prefetch", avs_new_value_array(args, 2), NULL);
+    if(avs_is_error(tmp)) {
+        fprintf(stderr, "Error: %s.\n", avs_as_string(tmp));
+        avs_h->func.avs_release_value(args[0]);
+        return -1;
+    }
+    avs_h->func.avs_release_value(internal_avs_update_clip(avs_h, inf, tmp, args[0]));
+    return 1;
+}
+
+/* -memmax and -cachehint, applied to every script environment of a run */
+typedef struct {
+    int memmax;             // MiB for each environment, 0 = AviSynth's default
+    int hint;               // AVS_CACHE_* for the output clip, 0 = none
+    int hint_range;
+} memory_t;
+
+/* "nothing", "window:N" or "generic:N" */
+static int parse_cache_hint(memory_t *m, const char *arg)
+{
+    static const struct { const char *name; int hint; } hints[] = {
+        {"nothing", AVS_CACHE_NOTHING}, {"window", AVS_CACHE_WINDOW}, {"generic", AVS_CACHE_GENERIC}
+    };
+    for(int i = 0; i < 3; i++) {
+        size_t len = strlen(hints[i].name);
+        if(strncmp(arg, hints[i].name, len))
+            continue;
+        m->hint = hints[i].hint;
+        m->hint_range = 0;
+        if(!arg[len])
+            return hints[i].hint == AVS_CACHE_NOTHING ? 0 : -1;
+        char *end;
+        m->hint_range = arg[len] == ':' ? strtol(arg + len + 1, &end, 10) : -1;
+        return m->hint_range > 0 && !*end && hints[i].hint != AVS_CACHE_NOTHING ? 0 : -1;
+    }
+    return -1;
+}
+
+static void set_memory(avs_hnd_t *avs_h, const memory_t *m)
+{
+    if(m->memmax > 0)
+        avs_h->func.avs_set_memory_max(avs_h->env, m->memmax);
+    if(m->hint)
+        avs_h->func.avs_set_cache_hints(avs_h->clip, m->hint, m->hint_range);
+}
+
+/* the share of 'total' MiB for each of 'envs' environments; rounded down, so together they
+ * stay within the limit, but at least 1 MiB, since 0 would mean AviSynth's default */
+static int memory_share(int64_t total, int envs)
+{
+    return total / envs > 0 ? (int)(total / envs) : 1;
+}
+
+/* -memmax auto: half of the cgroup limit, shared by 'envs' environments; 0 without a limit */
+static int memory_auto(int envs)
+{
+    int64_t limit = cgroup_memory_limit();
+    return limit > 0 ? memory_share(limit / 2 / (1024 * 1024), envs) : 0;
+}
+
+/* the frames of a run: one range for -seek/-frames, any number of them for -ranges. Ranges
+ * are sorted by their first frame, so neighbouring ones are rendered back to back while the
+ * script still has their surroundings cached; 'pos' is where a range starts in the output. */
+typedef struct {
+    int first;
+    int end;                // one past the last frame
+    int pos;
+} frame_range_t;
+
+typedef struct {
+    frame_range_t *range;
+    int count;
+    int frames;
+} schedule_t;
+
+static int range_compare(const void *a, const void *b)
+{
+    const frame_range_t *x = a, *y = b;
+    if(x->first != y->first)
+        return x->first < y->first ? -1 : 1;
+    return (x->end > y->end) - (x->end < y->end);
+}
+
+/* parses "A-B,C,D-" into s: A to B inclusive, the single frame C, and D up to the last frame.
+ * "@FILE" reads the list from a file, where ranges may also be separated by whitespace or
+ * newlines and '#' starts a comment. */
+static int parse_ranges(schedule_t *s, const char *list)
+{
+    char *buf = NULL;
+    if(*list == '@') {
+        FILE *fh = fopen(list + 1, "rb");
+        long size = -1;
+        if(fh && !fseek(fh, 0, SEEK_END) && (size = ftell(fh)) >= 0 && !fseek(fh, 0, SEEK_SET) &&
+           (buf = malloc(size + 1)) && fread(buf, 1, size, fh) == (size_t)size)
+            buf[size] = 0;
+        else {
+            fprintf(stderr, "Error: failed to read the range list \"%s\".\n", list + 1);
+            free(buf);
+            buf = NULL;
+        }
+        if(fh)
+            fclose(fh);
+        if(!buf)
+            return -1;
+        for(char *c = strchr(buf, '#'); c; c = strchr(c, '#'))
+            while(*c && *c != '\n')
+                *c++ = ' ';
+    } else if(!(buf = strdup(list)))
+        return -1;
+    int size = 0;
+    memset(s, 0, sizeof(*s));
+    for(char *tok = strtok(buf, ", \t\r\n"); tok; tok = strtok(NULL, ", \t\r\n")) {
+        char *p;
+        long first = strtol(tok, &p, 10), last = first;
+        if(*p == '-' && !p[1]) {
+            last = INT_MAX - 1;
+            p++;
+        }
+        else if(*p == '-')
+            last = strtol(p + 1, &p, 10);
+        if(p == tok || *p || first < 0 || last < first || last >= INT_MAX) {
+            fprintf(stderr, "Error: \"%s\" is not a valid frame range.\n", tok);
+            goto fail;
+        }
+        if(s->count == size) {
+            frame_range_t *range = realloc(s->range, (size = size ? size * 2 : 16) * sizeof(*range));
+            if(!range)
+                goto fail;
+            s->range = range;
+        }
+        s->range[s->count].first = first;
+        s->range[s->count].end = last + 1;
+        s->count++;
+    }
+    free(buf);
+    if(!s->count) {
+        fprintf(stderr, "Error: the range list \"%s\" is empty.\n", list);
+        return -1;
+    }
+    qsort(s->range, s->count, sizeof(*s->range), range_compare);
+    return 0;
+fail:
+    free(buf);
+    free(s->range);
+    s->range = NULL;
+    return -1;
+}
+
+/* clips the ranges to the clip and works out where each of them starts in the output */
+static int schedule_fit(schedule_t *s, int num_frames)
+{
+    int64_t pos = 0;
+    for(int r = 0; r < s->count; r++) {
+        if(s->range[r].first >= num_frames) {
+            fprintf(stderr, "Error: range starting at frame %d is past the end of the clip (%d frames).\n", s->range[r].first, num_frames);
+            return -1;
+        }
+        if(s->range[r].end > num_frames)
+            s->range[r].end = num_frames;
+        s->range[r].pos = pos;
+        pos += s->range[r].end - s->range[r].first;
+        if(pos > INT_MAX) {
+            fprintf(stderr, "Error: the ranges add up to more than %d frames.\n", INT_MAX);
+            return -1;
+        }
+    }
+    s->frames = pos;
+    return 0;
+}
+
+/* whether one of the ranges starts at frame 'frm' */
+static int schedule_starts_at(const schedule_t *s, int frm)
+{
+    int lo = 0, hi = s->count - 1;
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if(s->range[mid].first == frm)
+            return 1;
+        if(s->range[mid].first < frm)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return 0;
+}
+
+/* drops the first n frames of the schedule, for -resume */
+static void schedule_skip(schedule_t *s, int n)
+{
+    int r = 0;
+    for(; r < s->count && n >= s->range[r].end - s->range[r].first; r++)
+        n -= s->range[r].end - s->range[r].first;
+    memmove(s->range, s->range + r, (s->count - r) * sizeof(*s->range));
+    s->count -= r;
+    if(s->count)
+        s->range[0].first += n;
+    s->frames = 0;
+    for(r = 0; r < s->count; r++) {
+        s->range[r].pos = s->frames;
+        s->frames += s->range[r].end - s->range[r].first;
+    }
+}
+
+/* index of the range holding output position 'pos' */
+static int schedule_find(const schedule_t *s, int pos)
+{
+    int lo = 0, hi = s->count - 1;
+    while(lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if(s->range[mid].pos <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+#include "audio.c"
+
+/* render thread: requests frames ahead of the writer and holds them in a bounded queue.
+ * With -parallel, each worker opens its own script environment and renders every
+ * 'workers'-th chunk of the schedule, starting 'preroll' frames early to settle temporal
+ * filters; the same goes for every range a chunk runs into. */
+typedef struct {
+    avs_hnd_t *avs_h;
+    avs_hnd_t own;
+    const char *infile;
+    int fields;
+    int threads;
+    const memory_t *memory;
+    const schedule_t *sched;
+    int chunk;
+    int preroll;
+    int index;
+    int workers;
+    pthread_mutex_t *render;    // with -a, audio_render for the worker on the shared environment
+    frame_queue_t queue;
+    pthread_t thread;
+} prefetch_t;
+
+static int prefetch_render(prefetch_t *pf, int frm, frame_t *f)
+{
+    if(pf->render)
+        pthread_mutex_lock(pf->render);
+    *f = render_frame(pf->avs_h, pf->fields, frm);
+    const char *err = pf->avs_h->func.avs_clip_get_error(pf->avs_h->clip);
+    if(pf->render)
+        pthread_mutex_unlock(pf->render);
+    if(err) {
+        fprintf(stderr, "Error: %s occurred while reading frame %d.\n", err, frm);
+        frame_release(pf->avs_h, *f);
+        *f = (frame_t){NULL};
+        return -1;
+    }
+    return 0;
+}
+
+static void *prefetch_thread(void *arg)
+{
+    prefetch_t *pf = arg;
+    const schedule_t *s = pf->sched;
+    pin_thread(1);
+    if(pf->infile) {
+        const AVS_VideoInfo *inf;
+        if(open_script(pf->avs_h, pf->infile, &inf) ||
+           (pf->threads && set_threads(pf->avs_h, pf->infile, &inf, pf->threads) < 0)) {
+            fprintf(stderr, "Error: render worker %d failed to open \"%s\".\n", pf->index, pf->infile);
+            goto done;
+        }
+        set_memory(pf->avs_h, pf->memory);
+    }
+    for(int first = pf->index * pf->chunk; first < s->frames; first += pf->workers * pf->chunk) {
+        int last = first + pf->chunk < s->frames ? first + pf->chunk : s->frames;
+        for(int pos = first; pos < last; pos++) {
+            const frame_range_t *r = &s->range[schedule_find(s, pos)];
+            int frm = r->first + pos - r->pos;
+            if(pos == first || pos == r->pos) {
+                for(int p = frm - pf->preroll > 0 ? frm - pf->preroll : 0; p < frm; p++) {
+                    frame_t f;
+                    if(prefetch_render(pf, p, &f))
+                        goto done;
+                    frame_release(pf->avs_h, f);
+                }
+            }
+            frame_t f;
+            if(prefetch_render(pf, frm, &f))
+                goto done;
+            if(frame_queue_push(&pf->queue, f)) {
+                frame_release(pf->avs_h, f);
+                goto done;
+            }
+        }
+    }
+done:
+    frame_queue_close(&pf->queue);
+    return NULL;
+}
+
+/* avs_h is shared with the main thread unless infile is given, in which case the worker
+ * imports its own copy of the script on the same library */
+static int prefetch_start(prefetch_t *pf, avs_hnd_t *avs_h, const char *infile, int fields, int size, const schedule_t *sched)
+{
+    pf->avs_h = avs_h;
+    if(infile) {
+        pf->own = *avs_h;
+        pf->own.env = NULL;
+        pf->own.clip = NULL;
+        pf->avs_h = &pf->own;
+    }
+    pf->infile = infile;
+    pf->fields = fields;
+    pf->sched = sched;
+    if(!pf->chunk) {
+        pf->chunk = sched->frames > 0 ? sched->frames : 1;
+        pf->workers = 1;
+    }
+    if(frame_queue_init(&pf->queue, size))
+        return -1;
+    if(pthread_create(&pf->thread, NULL, prefetch_thread, pf)) {
+        frame_queue_free(&pf->queue, pf->avs_h);
+        return -1;
+    }
+    return 0;
+}
+
+static void prefetch_stop(prefetch_t *pf)
+{
+    if(!pf->queue.frames)
+        return;
+    frame_queue_abort(&pf->queue);
+    pthread_join(pf->thread, NULL);
+    frame_queue_free(&pf->queue, pf->avs_h);
+    if(pf->infile)
+        close_script(pf->avs_h);
+}
+
+static int read_full(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+    while(done < size) {
+        ssize_t ret = read(fd, (char*)buf + done, size - done);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            break;
+        done += ret;
+    }
+    return done == size ? 0 : -1;
+}
+
+/* cache of packed frames for the slave modes, evicting the least recently used frame
+ * once the memory budget is used up. When requests come in ascending order, a read-ahead
+ * thread renders the next frames into the cache while the client is busy with the current one. */
+typedef struct cache_entry_t {
+    int frame;              // -1 while the entry is being filled or holds nothing
+    int pins;               // handed out by frame_cache_get() and not yet put back
+    BYTE *data;
+    struct cache_entry_t *prev;     // LRU list, most recently used first
+    struct cache_entry_t *next;
+    struct cache_entry_t *hnext;    // hash chain
+} cache_entry_t;
+
+typedef struct {
+    const frame_layout_t *layout;
+    int num_frames;
+    int capacity;
+    int used;
+    cache_entry_t *entries;
+    cache_entry_t *head;
+    cache_entry_t *tail;
+    cache_entry_t **hash;
+    int hash_mask;
+    int readahead;
+    int last;               // previous request
+    int ahead_next;         // next frame the read-ahead thread renders
+    int ahead_end;
+    int rendering[2];       // frames being rendered by the client and the read-ahead thread
+    int stop;
+    int64_t hits;
+    int64_t misses;
+    int64_t read_ahead;
+    pthread_mutex_t mutex;  // everything above
+    pthread_mutex_t render; // avs_get_frame() is not called from two threads at once
+    pthread_cond_t cond;
+    pthread_t thread;
+    int has_thread;
+} frame_cache_t;
+
+static cache_entry_t *cache_find(frame_cache_t *c, int frm)
+{
+    cache_entry_t *e = c->hash[frm & c->hash_mask];
+    while(e && e->frame != frm)
+        e = e->hnext;
+    return e;
+}
+
+static void cache_unlink(frame_cache_t *c, cache_entry_t *e)
+{
+    if(e->prev)
+        e->prev->next = e->next;
+    else
+        c->head = e->next;
+    if(e->next)
+        e->next->prev = e->prev;
+    else
+        c->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void cache_push_front(frame_cache_t *c, cache_entry_t *e)
+{
+    e->prev = NULL;
+    e->next = c->head;
+    if(c->head)
+        c->head->prev = e;
+    else
+        c->tail = e;
+    c->head = e;
+}
+
+/* takes an entry out of the cache for refilling: an unused one while the budget allows,
+ * the least recently used unpinned one after that */
+static cache_entry_t *cache_reserve(frame_cache_t *c)
+{
+    cache_entry_t *e;
+    if(c->used < c->capacity) {
+        e = &c->entries[c->used];
+        e->data = malloc(c->layout->frame_size);
+        if(!e->data)
+            return NULL;
+        c->used++;
+        e->frame = -1;
+        return e;
+    }
+    for(e = c->tail; e && e->pins; e = e->prev);
+    if(!e)
+        return NULL;
+    cache_unlink(c, e);
+    if(e->frame >= 0) {
+        cache_entry_t **link = &c->hash[e->frame & c->hash_mask];
+        while(*link != e)
+            link = &(*link)->hnext;
+        *link = e->hnext;
+        e->hnext = NULL;
+    }
+    e->frame = -1;
+    return e;
+}
+
+/* puts a reserved entry back, filled with frame frm or empty when frm < 0 */
+static void cache_insert(frame_cache_t *c, cache_entry_t *e, int frm)
+{
+    if(frm >= 0 && !cache_find(c, frm)) {
+        e->frame = frm;
+        e->hnext = c->hash[frm & c->hash_mask];
+        c->hash[frm & c->hash_mask] = e;
+        cache_push_front(c, e);
+        return;
+    }
+    // empty entries go to the back so that they are reused first
+    e->prev = c->tail;
+    e->next = NULL;
+    if(c->tail)
+        c->tail->next = e;
+    else
+        c->head = e;
+    c->tail = e;
+}
+
+/* renders frame frm into e; returns the error message, if any */
+static const char *cache_render(frame_cache_t *c, cache_entry_t *e, int frm)
+{
+    avs_hnd_t *avs_h = c->layout->avs_h;
+    pthread_mutex_lock(&c->render);
+    frame_t f = render_frame(avs_h, c->layout->fields, frm);
+    const char *err = avs_h->func.avs_clip_get_error(avs_h->clip);
+    pthread_mutex_unlock(&c->render);
+    if(!err)
+        pack_frame(c->layout, f, e->data);
+    frame_release(avs_h, f);
+    return err;
+}
+
+static void *cache_thread(void *arg)
+{
+    frame_cache_t *c = arg;
+    pin_thread(1);
+    pthread_mutex_lock(&c->mutex);
+    while(!c->stop) {
+        if(c->ahead_next >= c->ahead_end) {
+            pthread_cond_wait(&c->cond, &c->mutex);
+            continue;
+        }
+        int frm = c->ahead_next++;
+        if(frm == c->rendering[0] || cache_find(c, frm))
+            continue;
+        cache_entry_t *e = cache_reserve(c);
+        if(!e)
+            continue;
+        c->rendering[1] = frm;
+        pthread_mutex_unlock(&c->mutex);
+        // frames that fail are left to the client request, which reports the error
+        const char *err = cache_render(c, e, frm);
+        pthread_mutex_lock(&c->mutex);
+        cache_insert(c, e, err ? -1 : frm);
+        if(!err)
+            c->read_ahead++;
+        c->rendering[1] = -1;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return NULL;
+}
+
+static int frame_cache_init(frame_cache_t *c, const frame_layout_t *layout, int num_frames, int64_t budget, int readahead)
+{
+    memset(c, 0, sizeof(*c));
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_mutex_init(&c->render, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    c->layout = layout;
+    c->num_frames = num_frames;
+    c->capacity = budget / layout->frame_size > INT_MAX / 2 ? INT_MAX / 2 : budget / layout->frame_size;
+    if(c->capacity < 1)
+        return -1;
+    // leave room for the frame the client holds while read-ahead fills the rest
+    c->readahead = readahead < c->capacity - 1 ? readahead : c->capacity - 1;
+    int hash_size = 16;
+    while(hash_size < 2 * c->capacity)
+        hash_size *= 2;
+    c->hash_mask = hash_size - 1;
+    c->entries = calloc(c->capacity, sizeof(cache_entry_t));
+    c->hash = calloc(hash_size, sizeof(cache_entry_t*));
+    if(!c->entries || !c->hash)
+        return -1;
+    c->last = -2;
+    c->rendering[0] = c->rendering[1] = -1;
+    if(c->readahead > 0) {
+        if(pthread_create(&c->thread, NULL, cache_thread, c))
+            return -1;
+        c->has_thread = 1;
+    }
+    return 0;
+}
+
+/* returns the packed frame frm, pinned until frame_cache_put(); NULL with *err set if it failed to render */
+static cache_entry_t *frame_cache_get(frame_cache_t *c, int frm, const char **err)
+{
+    *err = NULL;
+    pthread_mutex_lock(&c->mutex);
+    if(c->readahead) {
+        // two requests in a row for consecutive frames start the read-ahead, anything else stops it
+        int end = frm + 1 + c->readahead < c->num_frames ? frm + 1 + c->readahead : c->num_frames;
+        if(frm == c->last + 1) {
+            if(c->ahead_next <= frm || c->ahead_next > end)
+                c->ahead_next = frm + 1;
+            c->ahead_end = end;
+            pthread_cond_broadcast(&c->cond);
+        } else
+            c->ahead_end = c->ahead_next;
+    }
+    c->last = frm;
+    while(c->rendering[1] == frm)
+        pthread_cond_wait(&c->cond, &c->mutex);
+    cache_entry_t *e = cache_find(c, frm);
+    if(e) {
+        c->hits++;
+        e->pins++;
+        cache_unlink(c, e);
+        cache_push_front(c, e);
+        pthread_mutex_unlock(&c->mutex);
+        return e;
+    }
+    c->misses++;
+    e = cache_reserve(c);
+    if(!e) {
+        pthread_mutex_unlock(&c->mutex);
+        *err = "out of memory";
+        return NULL;
+    }
+    c->rendering[0] = frm;
+    pthread_mutex_unlock(&c->mutex);
+    *err = cache_render(c, e, frm);
+    pthread_mutex_lock(&c->mutex);
+    c->rendering[0] = -1;
+    if(*err) {
+        cache_insert(c, e, -1);
+        e = NULL;
+    } else {
+        cache_insert(c, e, frm);
+        e = cache_find(c, frm);
+        e->pins++;
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return e;
+}
+
+static void frame_cache_put(frame_cache_t *c, cache_entry_t *e)
+{
+    pthread_mutex_lock(&c->mutex);
+    e->pins--;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static void frame_cache_free(frame_cache_t *c)
+{
+    if(!c->layout)
+        return;
+    if(c->has_thread) {
+        pthread_mutex_lock(&c->mutex);
+        c->stop = 1;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+        pthread_join(c->thread, NULL);
+    }
+    for(int i = 0; i < c->used; i++)
+        free(c->entries[i].data);
+    free(c->entries);
+    free(c->hash);
+    pthread_mutex_destroy(&c->mutex);
+    pthread_mutex_destroy(&c->render);
+    pthread_cond_destroy(&c->cond);
+    c->layout = NULL;
+}
+
+/* Binary slave protocol (-slave2). All fields are in native byte order.
+ * On startup a slave2_info_t is written to every output. Requests are read from stdin:
+ *   SLAVE2_FRAME  one frame, 'first'
+ *   SLAVE2_RANGE  'count' frames starting at 'first'
+ *   SLAVE2_LIST   'count' frames whose numbers follow the request as int32 values
+ *   SLAVE2_QUIT   stop serving
+ * Each requested frame is answered with a slave2_response_t. If its slot is SLAVE2_INLINE,
+ * 'size' bytes of packed frame data follow it on the output; otherwise the data is in that
+ * slot of the -shm ring, which the client hands back by advancing the ring's read_seq. */
+#define SLAVE2_INFO_MAGIC 0x49593241 // "A2YI"
+#define SLAVE2_REQUEST_MAGIC 0x51593241 // "A2YQ"
+#define SLAVE2_RESPONSE_MAGIC 0x52593241 // "A2YR"
+#define SLAVE2_VERSION 2
+#define SLAVE2_INLINE 0xffffffff
+
+enum { SLAVE2_QUIT = 0, SLAVE2_FRAME = 1, SLAVE2_RANGE = 2, SLAVE2_LIST = 3 };
+enum { SLAVE2_OK = 0, SLAVE2_OUT_OF_RANGE = 1, SLAVE2_RENDER_ERROR = 2 };
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    uint32_t fps_num;
+    uint32_t fps_den;
+    uint32_t par_width;
+    uint32_t par_height;
+    int32_t num_frames;
+    char interlace;
+    char reserved[3];
+    uint32_t ring_slots;    // 0 unless frames are delivered through -shm
+    uint32_t reserved2;
+    uint64_t frame_size;
+    char csp[64];           // y4m colorspace tag; empty if there is none
+} slave2_info_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    int32_t first;
+    int32_t count;
+} slave2_request_t;
+
+typedef struct {
+    uint32_t magic;
+    int32_t frame;
+    int32_t status;
+    uint32_t slot;
+    uint64_t size;
+} slave2_response_t;
+
+static int slave2_respond(const frame_layout_t *layout, int num_frames, output_t *outputs, int out_fhs, shm_ring_t *ring, frame_cache_t *cache, int frm)
+{
+    avs_hnd_t *avs_h = layout->avs_h;
+    slave2_response_t resp = {SLAVE2_RESPONSE_MAGIC, frm, SLAVE2_OK, SLAVE2_INLINE, 0};
+    frame_t f = {NULL};
+    cache_entry_t *e = NULL;
+    if(frm < 0 || frm >= num_frames)
+        resp.status = SLAVE2_OUT_OF_RANGE;
+    else if(cache) {
+        const char *err;
+        e = frame_cache_get(cache, frm, &err);
+        if(e)
+            resp.size = layout->frame_size;
+        else {
+            fprintf(stderr, "Warning: %s occurred while reading frame %d.\n", err, frm);
+            resp.status = SLAVE2_RENDER_ERROR;
+        }
+    } else {
+        f = render_frame(avs_h, layout->fields, frm);
+        const char *err = avs_h->func.avs_clip_get_error(avs_h->clip);
+        if(err) {
+            fprintf(stderr, "Warning: %s occurred while reading frame %d.\n", err, frm);
+            resp.status = SLAVE2_RENDER_ERROR;
+            frame_release(avs_h, f);
+            f = (frame_t){NULL};
+        } else
+            resp.size = layout->frame_size;
+    }
+    int ret = 0;
+    if((f.frame || e) && ring) {
+        shm_slot_header_t *slot = shm_ring_acquire(ring, &b_ctrl_c);
+        if(!slot)
+            ret = -1;
+        else {
+            if(e)
+                memcpy(shm_slot_data(slot), e->data, layout->frame_size);
+            else
+                pack_frame(layout, f, shm_slot_data(slot));
+            resp.slot = shm_ring_publish(ring, frm, 0, layout->frame_size) % ring->hdr->slots;
+        }
+        // the frame is in the ring now, the outputs only get the response
+        frame_release(avs_h, f);
+        if(e)
+            frame_cache_put(cache, e);
+        f = (frame_t){NULL};
+        e = NULL;
+    }
+    // every path ends here, so the frame or cache entry is always let go of
+    for(int i = 0; i < out_fhs && !ret; i++) {
+        if(output_write(&outputs[i], &resp, sizeof(resp)) != sizeof(resp) ||
+           (f.frame && write_frame(&outputs[i], layout, f) != layout->frame_size) ||
+           (e && write_packed(&outputs[i], layout, e->data) != layout->frame_size)) {
+            fprintf(stderr, "Error: failed to write to \"%s\".\n", outputs[i].name);
+            ret = -1;
+        }
+    }
+    frame_release(avs_h, f);
+    if(e)
+        frame_cache_put(cache, e);
+    return ret;
+}
+
+/* answers requests from stdin until it is closed or a quit request comes in */
+static int slave2_serve(const frame_layout_t *layout, int num_frames, output_t *outputs, int out_fhs, shm_ring_t *ring, frame_cache_t *cache)
+{
+    slave2_request_t req;
+    #if defined(AVS_WINDOWS)
+    _setmode(0, _O_BINARY);
+    #endif
+    while(!b_ctrl_c && !read_full(0, &req, sizeof(req))) {
+        if(req.magic != SLAVE2_REQUEST_MAGIC || req.type > SLAVE2_LIST || (req.type != SLAVE2_FRAME && req.count < 0)) {
+            fprintf(stderr, "Error: malformed slave request.\n");
+            return -1;
+        }
+        if(req.type == SLAVE2_QUIT)
+            break;
+        int count = req.type == SLAVE2_FRAME ? 1 : req.count;
+        for(int i = 0; i < count; i++) {
+            int32_t frm = req.first + i;
+            if(req.type == SLAVE2_LIST && read_full(0, &frm, sizeof(frm))) {
+                fprintf(stderr, "Error: truncated slave request.\n");
+                return -1;
+            }
+            if(slave2_respond(layout, num_frames, outputs, out_fhs, ring, cache, frm))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* reference reader for shm:NAME outputs (-shmread): turns the ring back into y4m or raw data */
+static int shm_read(const char *name, output_t *outputs, int out_fhs, int nostderr)
+{
+    shm_ring_t ring;
+    frame_layout_t layout = {0};
+    int retval = 1;
+    int frames = 0;
+    if(shm_ring_open(&ring, name)) {
+        fprintf(stderr, "Error: failed to open shared memory ring \"%s\".\n", name);
+        return 1;
+    }
+    const shm_ring_header_t *h = ring.hdr;
+    layout.frame_size = h->frame_size;
+    layout.max_iov = 2;
+    if(!nostderr) {
+        fprintf(stderr, "Ring:\t\t%s, %u slots of %"PRIu64" bytes\nResolution:\t%dx%d\n", name, h->slots, h->frame_size, h->width, h->height);
+        fprintf(stderr, "Frames per sec:\t%u/%u\n", h->fps_num, h->fps_den);
+    }
+    for(int i = 0; i < out_fhs; i++) {
+        if(output_open(&outputs[i], &layout))
+            goto fail;
+        if(!outputs[i].y4m_header)
+            continue;
+        if(!h->csp[0]) {
+            fprintf(stderr, "Error: unsupported colorspace.\nUse \"-raw\" to read this ring without headers.\n");
+            goto fail;
+        }
+        char header[400];
+        int len = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%u:%u I%c A%u:%u %.64s\n", h->width, h->height, h->fps_num, h->fps_den, h->interlace, h->par_width, h->par_height, h->csp);
+        if(output_write(&outputs[i], header, len) != len) {
+            fprintf(stderr, "Error: failed to write to \"%s\".\n", outputs[i].name);
+            goto fail;
+        }
+    }
+    shm_slot_header_t *slot;
+    while((slot = shm_ring_next(&ring, &b_ctrl_c))) {
+        for(int i = 0; i < out_fhs; i++)
+            if(slot->status || slot->size != h->frame_size || write_packed(&outputs[i], &layout, shm_slot_data(slot)) != layout.frame_size) {
+                fprintf(stderr, "Error: failed to write to \"%s\".\n", outputs[i].name);
+                goto fail;
+            }
+        shm_ring_release(&ring);
+        frames++;
+    }
+    if(!nostderr)
+        fprintf(stderr, "Total frames:\t%d\n", frames);
+    retval = 0;
+fail:
+    for(int i = 0; i < out_fhs; i++)
+        output_close(&outputs[i], &layout, !retval);
+    shm_ring_close(&ring);
+    return retval;
+}
+
+/* -avzread: decodes an avz: output back into y4m or raw data; -seek and -frames pick a range,
+ * found through the index */
+static int avz_read(const char *path, output_t *outputs, int out_fhs, int seek, int frames, int nostderr)
+{
+    avz_reader_t r;
+    frame_layout_t layout = {0};
+    BYTE *buf = NULL;
+    int retval = 1;
+    if(avz_reader_open(&r, path)) {
+        fprintf(stderr, "Error: \"%s\" is not an avz file.\n", path);
+        return 1;
+    }
+    for(uint32_t p = 0; p < r.hdr.planes; p++)
+        layout.frame_size += (int64_t)r.hdr.row_size[p] * r.hdr.height[p];
+    layout.max_iov = 2;
+    int end = frames > 0 && frames < r.frames - seek ? seek + frames : r.frames;
+    if(!nostderr) {
+        fprintf(stderr, "Avz file:\t%s, %d frames%s\n", path, r.frames, r.hdr.index_offset ? "" : " (not finished, no index)");
+        fprintf(stderr, "Stream:\t\t%.*s\n", (int)strcspn(r.hdr.y4m, "\n"), r.hdr.y4m);
+    }
+    if(!(buf = malloc(layout.frame_size)))
+        goto fail;
+    for(int i = 0; i < out_fhs; i++) {
+        if(output_open(&outputs[i], &layout))
+            goto fail;
+        int len = strlen(r.hdr.y4m);
+        if(outputs[i].y4m_header && output_write(&outputs[i], r.hdr.y4m, len) != len) {
+            fprintf(stderr, "Error: failed to write to \"%s\".\n", outputs[i].name);
+            goto fail;
+        }
+    }
+    for(int frm = seek; frm < end && !b_ctrl_c; frm++) {
+        if(avz_read_frame(&r, frm, buf)) {
+            fprintf(stderr, "Error: frame %d of \"%s\" is damaged.\n", frm, path);
+            goto fail;
+        }
+        for(int i = 0; i < out_fhs; i++)
+            if(write_packed(&outputs[i], &layout, buf) != layout.frame_size) {
+                fprintf(stderr, "Error: failed to write to \"%s\".\n", outputs[i].name);
+                goto fail;
+            }
+    }
+    retval = 0;
+fail:
+    for(int i = 0; i < out_fhs; i++)
+        output_close(&outputs[i], &layout, !retval);
+    free(buf);
+    avz_reader_close(&r);
+    return retval;
+}
+
+/* writer thread per output, so a slow destination only holds back the renderer
+ * once it falls 'lag' frames behind */
+typedef struct {
+    output_t *out;
+    const frame_layout_t *layout;
+    frame_queue_t queue;
+    pthread_t thread;
+    int error;
+} writer_t;
+
+static void *writer_thread(void *arg)
+{
+    writer_t *w = arg;
+    frame_t f;
+    pin_thread(0);
+    while((f = frame_queue_pop(&w->queue)).frame) {
+        int64_t wrote = write_frame(w->out, w->layout, f);
+        frame_release(w->layout->avs_h, f);
+        frame_queue_release(&w->queue);
+        if(wrote != w->layout->frame_size) {
+            fprintf(stderr, "Error: wrote only %"PRId64" of %"PRId64" bytes to \"%s\".\n", wrote, w->layout->frame_size, w->out->name);
+            w->error = 1;
+            frame_queue_abort(&w->queue);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int writer_start(writer_t *w, output_t *out, const frame_layout_t *layout)
+{
+    w->out = out;
+    w->layout = layout;
+    w->error = 0;
+    if(frame_queue_init(&w->queue, out->lag > 0 ? out->lag : 1))
+        return -1;
+    if(pthread_create(&w->thread, NULL, writer_thread, w)) {
+        frame_queue_free(&w->queue, layout->avs_h);
+        return -1;
+    }
+    return 0;
+}
+
+/* hands a new reference of the frame to the writer; 'block' writers are waited on until done */
+static int writer_push(writer_t *w, frame_t f)
+{
+    frame_t ref = frame_ref(w->layout->avs_h, f);
+    if(frame_queue_push(&w->queue, ref)) {
+        frame_release(w->layout->avs_h, ref);
+        return -1;
+    }
+    if(w->out->lag <= 0)
+        return frame_queue_wait_idle(&w->queue);
+    return 0;
+}
+
+/* with 'drain' set, lets the writer finish its queue; otherwise drops what is left */
+static int writer_stop(writer_t *w, int drain)
+{
+    if(!w->queue.frames)
+        return 0;
+    if(drain)
+        frame_queue_close(&w->queue);
+    else
+        frame_queue_abort(&w->queue);
+    pthread_join(w->thread, NULL);
+    frame_queue_free(&w->queue, w->layout->avs_h);
+    return w->error ? -1 : 0;
+}
+
+#include "server.c"
+#include "batch.c"
+
+/* -bench sinks: drop frames untouched, pack them into a scratch buffer, or write them to the outputs */
+enum { BENCH_OFF, BENCH_NULL, BENCH_COPY, BENCH_WRITE };
+enum { STAGE_RENDER, STAGE_COPY, STAGE_WRITE, STAGE_COUNT };
+
+static void bench_report(int sink, int frames, int64_t frame_size, const int64_t *stage, int64_t elapsed)
+{
+    static const char *sinks[] = {"", "null", "copy", "write"};
+    static const char *stages[] = {"render:", "copy:", "write:"};
+    double secs = elapsed / 1000000.;
+    fprintf(stderr, "Bench:\t\t%d frames in %.3f s, %.2f fps (%s sink)\n", frames, secs, secs > 0 ? frames / secs : 0, sinks[sink]);
+    for(int i = 0; i < STAGE_COUNT; i++) {
+        if((i == STAGE_COPY && sink != BENCH_COPY) || (i == STAGE_WRITE && sink != BENCH_WRITE))
+            continue;
+        double t = stage[i] / 1000000.;
+        fprintf(stderr, "  %-8s%8.3f s (%5.1f%%)", stages[i], t, elapsed > 0 ? 100. * stage[i] / elapsed : 0);
+        if(i && t > 0)
+            fprintf(stderr, ", %.1f MiB/s", (double)frames * frame_size / (1024 * 1024) / t);
+        fprintf(stderr, "\n");
+    }
+}
+
+/* -report: render, wait and write latencies plus per-output totals as JSON, and the memory
+ * the run took: peak RSS and the cache limit AviSynth reports (0 where either isn't known) */
+static int write_report(const char *path, const char *infile, const char *status, int frames, int64_t elapsed,
+                        const latency_t *wait, const latency_t *push, const output_t *outputs, int out_fhs, int avs_memory_max)
+{
+    FILE *fh = fopen(path, "w");
+    if(!fh) {
+        fprintf(stderr, "Error: failed to create report \"%s\".\n", path);
+        return -1;
+    }
+    fprintf(fh, "{\n  \"version\": 1,\n  \"script\": ");
+    json_string(fh, infile ? infile : "");
+    fprintf(fh, ",\n  \"status\": \"%s\",\n  \"frames\": %d,\n  \"elapsed_us\": %"PRId64",\n  \"fps\": %.3f",
+            status, frames, elapsed, elapsed > 0 ? frames * 1000000. / elapsed : 0);
+    fprintf(fh, ",\n  \"peak_rss_kib\": %"PRId64",\n  \"avs_memory_max_mib\": %d", peak_rss_kib(), avs_memory_max);
+    fprintf(fh, ",\n  \"render\": ");
+    pthread_mutex_lock(&render_latency_mutex);
+    latency_json(fh, &render_latency);
+    pthread_mutex_unlock(&render_latency_mutex);
+    // time the frame loop spent waiting for render threads or the slave cache, and for writer threads
+    if(wait->count) {
+        fprintf(fh, ",\n  \"wait\": ");
+        latency_json(fh, wait);
+    }
+    if(push->count) {
+        fprintf(fh, ",\n  \"backpressure\": ");
+        latency_json(fh, push);
+    }
+    fprintf(fh, ",\n  \"outputs\": [");
+    for(int i = 0; i < out_fhs; i++) {
+        fprintf(fh, "%s\n    {\"name\": ", i ? "," : "");
+        json_string(fh, outputs[i].name_template ? outputs[i].name_template : outputs[i].name);
+        fprintf(fh, ", \"bytes\": %"PRId64", \"write\": ", outputs[i].bytes);
+        latency_json(fh, &outputs[i].write_latency);
+        fprintf(fh, "}");
+    }
+    fprintf(fh, "\n  ]\n}\n");
+    if(fclose(fh)) {
+        fprintf(stderr, "Error: failed to write report \"%s\".\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* -checkpoint: a small text file naming the job and how many frames every output holds.
+ * The outputs are synced before it is written, and it is replaced with a rename, so after
+ * a crash it never promises frames that didn't make it to disk. */
+#define CHECKPOINT_INTERVAL 1000000 // us
+
+typedef struct {
+    char script[4096];
+    int64_t frame_size;
+    int first;              // first frame and length of the schedule the outputs were started with
+    int total;
+    int frames;             // frames in every output
+} checkpoint_t;
+
+/* 1 if there is no checkpoint yet, -1 if it can't be used */
+static int checkpoint_read(const char *path, checkpoint_t *ck)
+{
+    char line[4200];
+    int version = 0, fields = 0;
+    FILE *fh = fopen(path, "r");
+    if(!fh)
+        return errno == ENOENT ? 1 : -1;
+    memset(ck, 0, sizeof(*ck));
+    while(fgets(line, sizeof(line), fh)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if(sscanf(line, "avs2yuv checkpoint %d", &version) == 1)
+            continue;
+        if(!strncmp(line, "script=", 7)) {
+            snprintf(ck->script, sizeof(ck->script), "%.4095s", line + 7);
+            fields++;
+        } else // sscanf gives EOF for an empty line, so only count the keys that matched
+            fields += (sscanf(line, "frame_size=%"SCNd64, &ck->frame_size) == 1) + (sscanf(line, "first=%d", &ck->first) == 1) +
+                      (sscanf(line, "total=%d", &ck->total) == 1) + (sscanf(line, "frames=%d", &ck->frames) == 1);
+    }
+    fclose(fh);
+    if(version != 1 || fields != 5 || ck->frames < 0 || ck->frames > ck->total) {
+        fprintf(stderr, "Error: \"%s\" is not a valid checkpoint.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* syncs the outputs and records the frames all of them hold; ck->frames is what they held
+ * when this run started */
+static int checkpoint_write(const char *path, const checkpoint_t *ck, output_t *outputs, int out_fhs)
+{
+    char tmp[4096];
+    int frames = INT_MAX;
+    for(int i = 0; i < out_fhs; i++) {
+        int done = __atomic_load_n(&outputs[i].frames, __ATOMIC_ACQUIRE);
+        if(done < frames)
+            frames = done;
+    }
+    for(int i = 0; i < out_fhs; i++)
+        if(outputs[i].fd >= 0)
+            fd_sync(outputs[i].fd);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fh = fopen(tmp, "w");
+    if(!fh) {
+        fprintf(stderr, "Error: failed to create checkpoint \"%s\".\n", tmp);
+        return -1;
+    }
+    fprintf(fh, "avs2yuv checkpoint 1\nscript=%s\nframe_size=%"PRId64"\nfirst=%d\ntotal=%d\nframes=%d\n",
+            ck->script, ck->frame_size, ck->first, ck->total, ck->frames + (out_fhs ? frames : 0));
+    int err = fflush(fh) || fd_sync(fileno(fh));
+    err |= fclose(fh);
+    #if defined(AVS_WINDOWS)
+    remove(path);
+    #endif
+    if(err || rename(tmp, path)) {
+        fprintf(stderr, "Error: failed to write checkpoint \"%s\".\n", path);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* reopens a file from an earlier run, checks its header and cuts it back to 'frames' whole frames */
+static int output_resume(output_t *out, const char *header, int header_len, int64_t frame_size, int frames)
+{
+    char buf[400];
+    struct stat st;
+    int head = out->y4m_header ? header_len : 0;
+    int64_t size = head + frames * (frame_size + (out->y4m_header ? 6 : 0));
+    out->fd = open(out->name, O_RDWR | O_BINARY);
+    if(out->fd < 0 || fstat(out->fd, &st) || st.st_size < size || (head && (read_full(out->fd, buf, head) || memcmp(buf, header, head)))) {
+        fprintf(stderr, "Error: \"%s\" doesn't start with the %d frames the checkpoint lists.\n", out->name, frames);
+        return -1;
+    }
+    if(fd_truncate(out->fd, size) || fd_seek(out->fd, size, SEEK_SET) != size) {
+        fprintf(stderr, "Error: failed to cut \"%s\" back to %d frames.\n", out->name, frames);
+        return -1;
+    }
+    out->resumed = 1;
+    return 0;
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* infile = NULL;
+    output_t outputs[MAX_FH] = {{0}};
+    int out_fhs = 0;
+    int nostderr = 0;
+    int usage = 0;
+    int seek = 0;
+    int end = 0;
+    const char *ranges = NULL;
+    schedule_t sched = {0};
+    frame_range_t whole = {0};
+    int range = 0;
+    int segment = 0;
+    const char *cut_list = NULL;
+    schedule_t cuts = {0};
+    int segment_frames = 0;
+    const char *manifest_path = NULL;
+    FILE *manifest = NULL;
+    const char *checkpoint_path = NULL;
+    checkpoint_t checkpoint = {{0}};
+    int checkpoint_ready = 0;
+    int64_t checkpoint_time = 0;
+    int resume = 0;
+    int io = IO_BUFFERED;
+    const char *avz_input = NULL;
+    int avz_threads = 0;
+    int slave = 0;
+    const char *report = NULL;
+    latency_t wait_latency = {0};
+    latency_t push_latency = {0};
+    int frames_done = 0;
+    int bench = BENCH_OFF;
+    int64_t bench_stage[STAGE_COUNT] = {0};
+    BYTE *bench_buf = NULL;
+    const char *shm_name = NULL;
+    int shm_slots = 4;
+    shm_ring_t ring = {0};
+    const char *shm_input = NULL;
+    const char *server_socket = NULL;
+    const char *batch = NULL;
+    int batch_jobs = 0;
+    const char *client_socket = NULL;
+    int keep = 4;
+    int reimport = 0;
+    int cache_mb = 0;
+    int readahead = 0;
+    int prefetch = 0;
+    int parallel = 0;
+    int chunk = 32;
+    int preroll = 0;
+    int threads = 0;
+    memory_t memory = {0};
+    int memmax = 0;                 // -memmax for the whole run, -1 = auto
+    const char *affinity = NULL;
+    int numa_node = -1;
+    int lag = 0;
+    int use_splice = 0;
+    int raw_output = 0;
+    int interlaced = 0;
+    int tff = 0;
+    int fields = 0;
+    int input_depth = 8;
+    output_format_t format = {0};
+    output_t alpha_out = {.fd = -1}; // -alpha: the alpha plane as a stream of its own
+    frame_layout_t alpha_layout = {0};
+    audio_out_t audio = {.fd = -1}; // -a
+    stats_t stats = {0};            // -stats
+    hash_t hash = {0};              // -hash and -hashcmp
+    int input_width;
+    int input_height;
+    unsigned fps_num = 0;
+    unsigned fps_den = 0;
+    unsigned par_width = 0;
+    unsigned par_height = 0;
+    int i_frame = 0;
+    int64_t i_frame_total = 0;
+    int64_t i_start = 0;
+    #if defined(AVS_WINDOWS)
+    SetConsoleTitle("avs2yuv: preparing frameserver");
+    #endif
+    for(int i = 1; i < argc; i++) {
+        if(argv[i][0] == '-' && argv[i][1] != 0) {
+            if(!strcmp(argv[i], "-h"))
+                usage = 1;
+            else if(!strcmp(argv[i], "-nstdr"))
+                nostderr = 1;
+            else if(!strcmp(argv[i], "-o")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -o needs an argument.\n");
+                    return 2;
+                }
+                i++;
+                goto add_outfile;
+            } else if(!strcmp(argv[i], "-seek")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -seek needs an argument.\n");
+                    return 2;
+                }
+                seek = atoi(argv[++i]);
+                if(seek < 0) usage = 1;
+            } else if(!strcmp(argv[i], "-frames")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -frames needs an argument.\n");
+                    return 2;
+                }
+                end = atoi(argv[++i]);
+            } else if(!strcmp(argv[i], "-ranges")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -ranges needs an argument.\n");
+                    return 2;
+                }
+                ranges = argv[++i];
+            } else if(!strcmp(argv[i], "-segment")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -segment needs an argument.\n");
+                    return 2;
+                }
+                if(argv[++i][0] == '@')
+                    cut_list = argv[i];
+                else if((segment = atoi(argv[i])) < 1) {
+                    fprintf(stderr, "Error: -segment \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-manifest")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -manifest needs an argument.\n");
+                    return 2;
+                }
+                manifest_path = argv[++i];
+            } else if(!strcmp(argv[i], "-checkpoint")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -checkpoint needs an argument.\n");
+                    return 2;
+                }
+                checkpoint_path = argv[++i];
+            } else if(!strcmp(argv[i], "-resume")) {
+                resume = 1;
+            } else if(!strcmp(argv[i], "-avzread")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -avzread needs an argument.\n");
+                    return 2;
+                }
+                avz_input = argv[++i];
+            } else if(!strcmp(argv[i], "-avzthreads")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -avzthreads needs an argument.\n");
+                    return 2;
+                }
+                avz_threads = atoi(argv[++i]);
+                if(avz_threads < 1) {
+                    fprintf(stderr, "Error: -avzthreads \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-io")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -io needs an argument.\n");
+                    return 2;
+                }
+                i++;
+                if(!strcmp(argv[i], "buffered"))
+                    io = IO_BUFFERED;
+                else if(!strcmp(argv[i], "direct"))
+                    io = IO_DIRECT;
+                else if(!strcmp(argv[i], "mmap"))
+                    io = IO_MMAP;
+                else {
+                    fprintf(stderr, "Error: -io \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+                #if !defined(AVS_POSIX)
+                if(io != IO_BUFFERED) {
+                    fprintf(stderr, "Error: -io %s is only supported on POSIX systems.\n", argv[i]);
+                    return 2;
+                }
+                #endif
+            } else if(!strcmp(argv[i], "-raw")) {
+                raw_output = 1;
+                if (!nostderr) {
+                    fprintf(stderr, "Warning: output will not contain any headers!\nYou will have to point resolution, framerate and format (and duration) manually to your reading software.\n");
+                }
+            } else if(!strcmp(argv[i], "-splice")) {
+                use_splice = 1;
+            } else if(!strcmp(argv[i], "-slave")) {
+                slave = 1;
+            } else if(!strcmp(argv[i], "-stats")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -stats needs an argument.\n");
+                    return 2;
+                }
+                stats.name = argv[++i];
+            } else if(!strcmp(argv[i], "-hash")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -hash needs an argument.\n");
+                    return 2;
+                }
+                hash.name = argv[++i];
+            } else if(!strcmp(argv[i], "-hashcmp")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -hashcmp needs an argument.\n");
+                    return 2;
+                }
+                hash.compare = argv[++i];
+            } else if(!strcmp(argv[i], "-report")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -report needs an argument.\n");
+                    return 2;
+                }
+                report = argv[++i];
+            } else if(!strcmp(argv[i], "-bench")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -bench needs an argument.\n");
+                    return 2;
+                }
+                i++;
+                if(!strcmp(argv[i], "null"))
+                    bench = BENCH_NULL;
+                else if(!strcmp(argv[i], "copy"))
+                    bench = BENCH_COPY;
+                else if(!strcmp(argv[i], "write"))
+                    bench = BENCH_WRITE;
+                else {
+                    fprintf(stderr, "Error: -bench \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-slave2")) {
+                slave = 2;
+            } else if(!strcmp(argv[i], "-shm")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -shm needs an argument.\n");
+                    return 2;
+                }
+                shm_name = argv[++i];
+            } else if(!strcmp(argv[i], "-server")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -server needs an argument.\n");
+                    return 2;
+                }
+                server_socket = argv[++i];
+            } else if(!strcmp(argv[i], "-client")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -client needs an argument.\n");
+                    return 2;
+                }
+                client_socket = argv[++i];
+            } else if(!strcmp(argv[i], "-batch")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -batch needs an argument.\n");
+                    return 2;
+                }
+                batch = argv[++i];
+            } else if(!strcmp(argv[i], "-jobs")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -jobs needs an argument.\n");
+                    return 2;
+                }
+                batch_jobs = atoi(argv[++i]);
+                if(batch_jobs < 1 || batch_jobs > SERVER_MAX_ENVS) {
+                    fprintf(stderr, "Error: -jobs \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-keep")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -keep needs an argument.\n");
+                    return 2;
+                }
+                keep = atoi(argv[++i]);
+                if(keep < 1 || keep > SERVER_MAX_ENVS) {
+                    fprintf(stderr, "Error: -keep \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-reimport")) {
+                reimport = 1;
+            } else if(!strcmp(argv[i], "-shmread")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -shmread needs an argument.\n");
+                    return 2;
+                }
+                shm_input = argv[++i];
+            } else if(!strcmp(argv[i], "-slots")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -slots needs an argument.\n");
+                    return 2;
+                }
+                shm_slots = atoi(argv[++i]);
+                if(shm_slots < 1) {
+                    fprintf(stderr, "Error: -slots \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-cache")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -cache needs an argument.\n");
+                    return 2;
+                }
+                cache_mb = atoi(argv[++i]);
+                if(cache_mb < 0) {
+                    fprintf(stderr, "Error: -cache \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-readahead")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -readahead needs an argument.\n");
+                    return 2;
+                }
+                readahead = atoi(argv[++i]);
+                if(readahead < 0) {
+                    fprintf(stderr, "Error: -readahead \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-prefetch")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -prefetch needs an argument.\n");
+                    return 2;
+                }
+                prefetch = atoi(argv[++i]);
+                if(prefetch < 0) {
+                    fprintf(stderr, "Error: -prefetch \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-parallel")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -parallel needs an argument.\n");
+                    return 2;
+                }
+                parallel = atoi(argv[++i]);
+                if(parallel < 0) {
+                    fprintf(stderr, "Error: -parallel \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-chunk")) {
                 if(i > argc-2) {
-                    fprintf(stderr, "Error: -o needs an argument.\n");
+                    fprintf(stderr, "Error: -chunk needs an argument.\n");
                     return 2;
                 }
-                i++;
-                goto add_outfile;
-            } else if(!strcmp(argv[i], "-seek")) {
+                chunk = atoi(argv[++i]);
+                if(chunk < 1) {
+                    fprintf(stderr, "Error: -chunk \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-preroll")) {
                 if(i > argc-2) {
-                    fprintf(stderr, "Error: -seek needs an argument.\n");
+                    fprintf(stderr, "Error: -preroll needs an argument.\n");
                     return 2;
                 }
-                seek = atoi(argv[++i]);
-                if(seek < 0) usage = 1;
-            } else if(!strcmp(argv[i], "-frames")) {
+                preroll = atoi(argv[++i]);
+                if(preroll < 0) {
+                    fprintf(stderr, "Error: -preroll \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-threads")) {
                 if(i > argc-2) {
-                    fprintf(stderr, "Error: -frames needs an argument.\n");
+                    fprintf(stderr, "Error: -threads needs an argument.\n");
                     return 2;
                 }
-                end = atoi(argv[++i]);
-            } else if(!strcmp(argv[i], "-raw")) {
-                raw_output = 1;
-                if (!nostderr) {
-                    fprintf(stderr, "Warning: output will not contain any headers!\nYou will have to point resolution, framerate and format (and duration) manually to your reading software.\n");
+                threads = strcmp(argv[++i], "auto") ? atoi(argv[i]) : -1;
+                if(!threads || threads < -1) {
+                    fprintf(stderr, "Error: -threads \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-memmax")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -memmax needs an argument.\n");
+                    return 2;
+                }
+                memmax = strcmp(argv[++i], "auto") ? atoi(argv[i]) : -1;
+                if(!memmax || memmax < -1) {
+                    fprintf(stderr, "Error: -memmax \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-cachehint")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -cachehint needs an argument.\n");
+                    return 2;
+                }
+                if(parse_cache_hint(&memory, argv[++i])) {
+                    fprintf(stderr, "Error: -cachehint \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-affinity")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -affinity needs an argument.\n");
+                    return 2;
+                }
+                affinity = argv[++i];
+            } else if(!strcmp(argv[i], "-numa")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -numa needs an argument.\n");
+                    return 2;
+                }
+                numa_node = atoi(argv[++i]);
+                if(numa_node < 0) {
+                    fprintf(stderr, "Error: -numa \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-lag")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -lag needs an argument.\n");
+                    return 2;
+                }
+                lag = atoi(argv[++i]);
+                if(lag < 0) {
+                    fprintf(stderr, "Error: -lag \"%s\" is not supported.\n", argv[i]);
+                    return 2;
                 }
-            } else if(!strcmp(argv[i], "-slave")) {
-                slave = 1;
             } else if(!strcmp(argv[i], "-depth")) {
                 if(i > argc-2) {
                     fprintf(stderr, "Error: -depth needs an argument.\n");
@@ -158,6 +2772,71 @@ int main(int argc, const char* argv[])
                     fprintf(stderr, "Error: -depth \"%s\" is not supported.\n", argv[i]);
                     return 2;
                 }
+            } else if(!strcmp(argv[i], "-bits")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -bits needs an argument.\n");
+                    return 2;
+                }
+                format.bits = atoi(argv[++i]);
+                if(format.bits < 8 || format.bits > 16) {
+                    fprintf(stderr, "Error: -bits \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-dither")) {
+                format.dither = 1;
+            } else if(!strcmp(argv[i], "-range")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -range needs an argument.\n");
+                    return 2;
+                }
+                i++;
+                if(!strcmp(argv[i], "full") || !strcmp(argv[i], "limited"))
+                    format.limited = !strcmp(argv[i], "limited");
+                else {
+                    fprintf(stderr, "Error: -range \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
+            } else if(!strcmp(argv[i], "-alpha")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -alpha needs an argument.\n");
+                    return 2;
+                }
+                alpha_out.name = argv[++i];
+                // the stream goes by its own name, not by -raw, which may come before or after it
+                const char *ext = strrchr(alpha_out.name, '.');
+                alpha_out.y4m_header = !(ext && (!strcasecmp(ext, ".yuv") || !strcasecmp(ext, ".raw")));
+            } else if(!strcmp(argv[i], "-rawalpha")) {
+                format.alpha_plane = 1;
+            } else if(!strcmp(argv[i], "-fields")) {
+                fields = 1;
+            } else if(!strcmp(argv[i], "-a")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -a needs an argument.\n");
+                    return 2;
+                }
+                audio.name = argv[++i];
+            } else if(!strcmp(argv[i], "-rawaudio")) {
+                audio.raw = 1;
+            } else if(!strcmp(argv[i], "-stacked")) {
+                format.stacked = 1;
+            } else if(!strcmp(argv[i], "-pack")) {
+                if(i > argc-2) {
+                    fprintf(stderr, "Error: -pack needs an argument.\n");
+                    return 2;
+                }
+                i++;
+                if(!strcmp(argv[i], "planar"))
+                    format.pack = PACK_PLANAR;
+                else if(!strcmp(argv[i], "p010"))
+                    format.pack = PACK_P010;
+                else if(!strcmp(argv[i], "p016"))
+                    format.pack = PACK_P016;
+                else if(!strcmp(argv[i], "v210"))
+                    format.pack = PACK_V210;
+                else {
+                    fprintf(stderr, "Error: -pack \"%s\" is not supported.\n", argv[i]);
+                    return 2;
+                }
             } else if(!strcmp(argv[i], "-fps")) {
                 if(i > argc-2) {
                     fprintf(stderr, "Error: -fps needs an argument.\n");
@@ -208,86 +2887,294 @@ add_outfile:
                 fprintf(stderr, "Error: too many output files.\n");
                 return 2;
             }
-            outfile[out_fhs] = argv[i];
-            y4m_headers[out_fhs] = !raw_output;
+            outputs[out_fhs].name = argv[i];
+            outputs[out_fhs].fd = -1;
+            outputs[out_fhs].y4m_header = !raw_output;
+            outputs[out_fhs].lag = lag;
+            outputs[out_fhs].splice = use_splice;
+            outputs[out_fhs].slots = shm_slots;
+            outputs[out_fhs].io = io;
+            outputs[out_fhs].encoders = avz_threads;
             out_fhs++;
         }
     }
-    if(usage || !infile || (!out_fhs && !nostderr)) {
+    if(bench && slave) {
+        fprintf(stderr, "Error: -bench can't be combined with -slave.\n");
+        return 2;
+    }
+    if(bench == BENCH_WRITE && !out_fhs) {
+        fprintf(stderr, "Error: -bench write needs an output.\n");
+        return 2;
+    }
+    if((bench == BENCH_NULL || bench == BENCH_COPY) && out_fhs) {
+        fprintf(stderr, "Warning: outputs are ignored with -bench %s.\n", bench == BENCH_NULL ? "null" : "copy");
+        out_fhs = 0;
+    }
+    if(ranges && (slave || client_socket || seek || end)) {
+        fprintf(stderr, "Error: -ranges can't be combined with -seek, -frames, -slave or -client.\n");
+        return 2;
+    }
+    if((segment || cut_list) && (slave || client_socket)) {
+        fprintf(stderr, "Error: -segment can't be combined with -slave or -client.\n");
+        return 2;
+    }
+    // -slave2 speaks its own binary protocol, whether it comes before or after the outputs
+    for(int i = 0; slave == 2 && i < out_fhs; i++)
+        outputs[i].y4m_header = 0;
+    int templates = 0;
+    for(int i = 0; (ranges || segment || cut_list) && i < out_fhs; i++) {
+        int t = name_is_template(outputs[i].name);
+        if(t < 0) {
+            fprintf(stderr, "Error: output \"%s\" should hold a single %%d for the first frame of each file.\n", outputs[i].name);
+            return 2;
+        }
+        if(t)
+            outputs[i].name_template = outputs[i].name;
+        templates += t;
+    }
+    if((segment || cut_list || manifest_path) && !templates && out_fhs) {
+        fprintf(stderr, "Error: %s needs an output named with %%d, such as part_%%05d.y4m.\n", manifest_path ? "-manifest" : "-segment");
+        return 2;
+    }
+    if(resume && !checkpoint_path) {
+        fprintf(stderr, "Error: -resume needs -checkpoint.\n");
+        return 2;
+    }
+    if(alpha_out.name && (slave || client_socket || checkpoint_path || !strncmp(alpha_out.name, "shm:", 4))) {
+        fprintf(stderr, "Error: -alpha can't be used with -slave, -client or -checkpoint, or go to a shm: ring.\n");
+        return 2;
+    }
+    if(audio.name && (slave || client_socket || checkpoint_path || shm_input || avz_input || server_socket)) {
+        fprintf(stderr, "Error: -a can't be used with -slave, -client, -checkpoint, -shmread, -avzread or -server.\n");
+        return 2;
+    }
+    if((stats.name || hash.name || hash.compare) && (slave || client_socket || shm_input || avz_input || server_socket || batch)) {
+        fprintf(stderr, "Error: -stats and -hash can't be used with -slave, -client, -shmread, -avzread, -server or -batch.\n");
+        return 2;
+    }
+    if(hash.name && hash.compare && hash_same_list(&hash)) {
+        fprintf(stderr, "Error: -hash \"%s\" would overwrite the -hashcmp list.\n", hash.name);
+        return 2;
+    }
+    if(checkpoint_path && (slave || client_socket || !out_fhs)) {
+        fprintf(stderr, "Error: -checkpoint needs file outputs and can't be combined with -slave or -client.\n");
+        return 2;
+    }
+    for(int i = 0; checkpoint_path && i < out_fhs; i++)
+        if(!strcmp(outputs[i].name, "-") || !strncmp(outputs[i].name, "shm:", 4) || !strncmp(outputs[i].name, "avz:", 4) ||
+           outputs[i].name_template || outputs[i].io) {
+            fprintf(stderr, "Error: -checkpoint can't resume \"%s\", only plain file outputs written with -io buffered.\n", outputs[i].name);
+            return 2;
+        }
+    for(int i = 0; i < out_fhs; i++)
+        if(!strncmp(outputs[i].name, "avz:", 4) && (slave || client_socket || avz_input || shm_input)) {
+            fprintf(stderr, "Error: avz: outputs can't be used with -slave, -client, -shmread or -avzread.\n");
+            return 2;
+        }
+    if(batch && (infile || out_fhs || slave || client_socket || server_socket || shm_input || avz_input || ranges ||
+                 segment || cut_list || checkpoint_path || alpha_out.name || audio.name || parallel > 1)) {
+        fprintf(stderr, "Error: -batch takes scripts and outputs from the job list, it can't be combined with outputs,\n"
+                        "-slave, -client, -server, -shmread, -avzread, -ranges, -segment, -checkpoint, -alpha, -a or -parallel.\n");
+        return 2;
+    }
+    if(client_socket && out_fhs != 1) {
+        fprintf(stderr, "Error: -client needs exactly one output.\n");
+        return 2;
+    }
+    if(usage || (!infile && !shm_input && !avz_input && !server_socket && !batch) || (!out_fhs && !nostderr && !bench && !server_socket && !batch && !hash.name && !hash.compare)) {
         fprintf(stderr, MY_VERSION "\n"AUTHORS "\n"
         "Usage: avs2yuv [options] in.avs [-o out.y4m] [-o out2.y4m]\n"
+        "       avs2yuv [options] -shmread NAME [-o out.y4m]\n"
+        "       avs2yuv [options] -avzread in.avz [-o out.y4m]\n"
+        "       avs2yuv [options] -server SOCKET\n"
+        "       avs2yuv [options] -client SOCKET in.avs [-o out.y4m]\n"
         "-nstdr\tdo not print info to stderr\n"
         "-seek\tseek to the given frame number\n"
         "-frames\tstop after processing this many frames\n"
+        "-ranges\trender a list of frame ranges such as 0-100,5000-5100 (or @FILE) in\n\tascending order; outputs named with %%d get one file per range,\n\tnumbered by its first frame, the others get all ranges back to back\n"
+        "-segment\tstart a new file every N frames, or at each frame listed in @FILE,\n\tfor outputs named with %%d\n"
+        "-manifest\tlist every finished file of a %%d output as path, first frame,\n\tlast frame and bytes, one tab separated line each\n"
+        "-checkpoint\tkeep a file with the number of frames the outputs safely hold,\n\tupdated every second and on exit\n"
+        "-resume\tcontinue the outputs from the -checkpoint of an earlier run\n\t(starts from scratch if there is none)\n"
         "-slave\tinit script and do nothing\n\t(useful for piping from TCPDeliver to AvsNetPipe)\n"
+        "-bench\tmeasure rendering speed without progress output; frames go to a\n\tnull sink, are copied to memory, or written to the outputs (null/copy/write)\n"
+        "-stats\twrite the min, max and average of every plane and the difference to the previous\n\tframe, plus scene cuts, to FILE as CSV (JSON if it ends in .json)\n"
+        "-hash\twrite a CRC32C of every plane of every frame, without padding, and a digest to FILE\n"
+        "-hashcmp\tcheck every frame against a -hash list and stop at the first one that differs\n"
+        "-report\twrite render and write latency histograms to a JSON file at exit\n"
+        "-slave2\tserve frames over the binary request protocol on stdin\n"
+        "-shm\twith -slave2, deliver frame data through the named shared memory ring\n"
+        "-slots\tframes a shared memory ring can hold (default 4)\n"
+        "-shmread\tread frames from the ring of a shm:NAME output instead of a script\n"
+        "-avzread\tdecode a file written by an avz:PATH output (with -seek and -frames)\n"
+        "-avzthreads\tthreads compressing the following avz:PATH outputs (default: online cpus)\n"
+        "-server\tkeep AviSynth loaded and render jobs sent to the given Unix socket\n"
+        "-keep\tscript environments a -server keeps while idle (default 4)\n"
+        "-reimport\tmake a -server or -batch import the script again for every job\n"
+        "-batch\trender the jobs of a list, one per line: script, output file and optionally\n\tthe frames as A-B, A- or A (-seek, -frames, -raw, -depth, -fields, -fps and -par apply)\n"
+        "-jobs\tjobs a -batch runs at a time (default: online or pinned cores, divided by -threads)\n"
+        "-client\thave the -server on the given socket render the script to the output\n\t(-seek, -frames, -raw, -depth, -fields, -fps and -par are passed along)\n"
+        "-cache\tkeep up to N MiB of rendered frames for -slave and -slave2 requests\n"
+        "-readahead\twith -cache, render up to N frames ahead of ascending requests\n"
+        "-prefetch\trender up to N frames ahead of output on a separate thread\n"
+        "-parallel\trender with N script environments, each taking every N-th chunk\n"
+        "-chunk\tframes per chunk with -parallel (default 32)\n"
+        "-preroll\tframes rendered and dropped before each chunk with -parallel\n"
+        "-threads\trun the script with AviSynth+ MT, Prefetch(N) (\"auto\" = online or pinned cores)\n"
+        "-memmax\tAviSynth cache limit in MiB for the whole run, split between the\n\tenvironments of -parallel, -server or -batch (\"auto\" = half of the cgroup memory limit)\n"
+        "-cachehint\tcache hint for the output clip: nothing, window:N or generic:N\n"
+        "-affinity\tpin rendering to a cpu list such as 0-7,16-23\n"
+        "-numa\tpin rendering to the cpus of the given NUMA node\n"
+        "-lag\tlet the following outputs fall up to N frames behind on their own\n\twriter threads (0 = block on every frame, the default)\n"
+        "-splice\tmove frames into pipes with vmsplice instead of copying them\n\t(applies to the following outputs, Linux only)\n"
+        "-io\twrite the following file outputs through the page cache (buffered, the\n\tdefault), with O_DIRECT from aligned buffers (direct) or through a mapped\n\twindow (mmap); the latter two reserve the file size up front (POSIX only)\n"
         "-raw\toutput raw data\n"
         "-depth\tspecify input bit depth\n\t(default 8, trying to guess from the script)\n"
+        "-alpha\twrite the alpha plane of the clip to FILE as a mono stream, y4m, or raw if FILE ends in .yuv or .raw\n"
+        "-rawalpha\t-raw outputs carry the alpha plane after the colour planes\n"
+        "-a\twrite the audio of the clip to FILE as W64, in step with the video frames\n"
+        "-rawaudio\t-a writes raw PCM samples instead\n"
+        "-fields\twrite fields as frames of their own: a fieldbased clip is not woven,\n\tthe frames of any other clip are split into their fields, first one first\n"
+        "-stacked\tthe -depth hack clip has its MSB rows over its LSB rows instead of interleaved samples\n"
+        "-bits\toutput bit depth, 8 to 16 (default: the depth of the clip)\n"
+        "-dither\tuse ordered dither instead of rounding when -bits lowers the depth or quantizes float\n"
+        "-range\tfull (default) or limited: the range float clips are quantized to\n"
+        "-pack\toutput layout: planar (default), p010, p016 (4:2:0) or v210 (4:2:2), with -raw\n"
         "-fps\toverwrite input framerate\n"
         "-par\tspecify pixel aspect ratio\n"
-        "The outfile may be \"-\", meaning stdout.\n"
+        "The outfile may be \"-\", meaning stdout, shm:NAME, a shared memory ring (POSIX only),\n"
+        "or avz:PATH, a losslessly compressed file for -avzread.\n"
         "Output format is yuv4mpeg, as used by MPlayer, FFmpeg, Libav, x264, mjpegtools.\n"
         );
         return 2;
     }
+    if(ranges && parse_ranges(&sched, ranges))
+        return 2;
+    if(cut_list && parse_ranges(&cuts, cut_list)) {
+        free(sched.range);
+        return 2;
+    }
+    if(avz_input)
+        return avz_read(avz_input, outputs, out_fhs, seek, end, nostderr);
+    if(shm_input)
+        return shm_read(shm_input, outputs, out_fhs, nostderr);
+    server_request_t req = {0}; // what -client and -batch jobs render with
+    if(client_socket || batch) {
+        req.seek = seek;
+        req.frames = end;
+        req.raw = raw_output;
+        req.depth = input_depth;
+        req.bits = format.bits;
+        req.dither = format.dither;
+        req.stacked = format.stacked;
+        req.pack = format.pack;
+        req.alpha_plane = format.alpha_plane;
+        req.fields = fields;
+        req.limited = format.limited;
+        req.fps_num = fps_num;
+        req.fps_den = fps_den;
+        req.par_width = par_width;
+        req.par_height = par_height;
+    }
+    if(client_socket)
+        return client_run(client_socket, &req, infile, &outputs[0], nostderr);
     int retval = 1;
     avs_hnd_t avs_h = {0};
-    if(internal_avs_load_library(&avs_h) < 0) {
-        fprintf(stderr, "Error: failed to load %s.\n", AVS_LIBNAME);
-        goto fail;
-    }
-    avs_h.env = avs_h.func.avs_create_script_environment(AVISYNTH_INTERFACE_VERSION);
-    if(avs_h.func.avs_get_error) {
-        const char *error = avs_h.func.avs_get_error(avs_h.env);
-        if(error) {
-            fprintf(stderr, "Error: %s.\n", error);
+    prefetch_t *pf = NULL;
+    int pf_count = 0;
+    writer_t writers[MAX_FH] = {{0}};
+    frame_layout_t layout = {0};
+    frame_cache_t frame_cache;
+    frame_cache_t *cache = NULL;
+    int threaded_writers = 0;
+    if(affinity || numa_node >= 0) {
+        char cpus[MAX_CPUS];
+        int count = affinity ? parse_cpu_list(affinity, cpus) : numa_node_cpus(numa_node, cpus);
+        if(count <= 0) {
+            if(affinity)
+                fprintf(stderr, "Error: -affinity \"%s\" is not a valid cpu list.\n", affinity);
+            else
+                fprintf(stderr, "Error: couldn't read the cpus of NUMA node %d.\n", numa_node);
+            goto fail;
+        }
+        if(pin_init(cpus, count)) {
+            fprintf(stderr, "Error: failed to set cpu affinity.\n");
             goto fail;
         }
     }
-    AVS_Value arg = avs_new_value_string(infile);
-    AVS_Value res = avs_h.func.avs_invoke(avs_h.env, "Import", arg, NULL);
-    if(avs_is_error(res)) {
-        fprintf(stderr, "Error: %s.\n", avs_as_string(res));
-        goto fail;
+    int cores = pin.count ? pin.count : online_cpus();
+    int auto_threads = threads < 0;
+    if(auto_threads)
+        threads = cores;
+    if(batch && !batch_jobs) {
+        batch_jobs = cores / (threads > 0 ? threads : 1);
+        batch_jobs = batch_jobs < 1 ? 1 : batch_jobs > SERVER_MAX_ENVS ? SERVER_MAX_ENVS : batch_jobs;
     }
-    if(!avs_is_clip(res)) {
-        fprintf(stderr, "Error: \"%s\" didn't return a video clip.\n", infile);
+    // the environments that render at the same time, each with its own Prefetch threads
+    int envs = server_socket ? keep : batch ? batch_jobs : parallel > 1 ? parallel : 1;
+    if(pin.count && threads * envs > pin.count) {
+        int fit = pin.count / envs > 0 ? pin.count / envs : 1;
+        if(!auto_threads && !nostderr)
+            fprintf(stderr, "-threads %d for each of %d environments is more than the %d pinned cpus, using %d.\n",
+                    threads, envs, pin.count, fit);
+        threads = fit;
+    }
+    if(memmax) {
+        memory.memmax = memmax > 0 ? memory_share(memmax, envs) : memory_auto(envs);
+        if(memmax < 0 && !memory.memmax && !nostderr)
+            fprintf(stderr, "No cgroup memory limit found, -memmax auto keeps the AviSynth default.\n");
+    }
+    if(internal_avs_load_library(&avs_h) < 0) {
+        fprintf(stderr, "Error: failed to load %s.\n", AVS_LIBNAME);
         goto fail;
     }
-    avs_h.clip = avs_h.func.avs_take_clip(res, avs_h.env);
-    const AVS_VideoInfo *inf = avs_h.func.avs_get_video_info(avs_h.clip);
-    if(!avs_has_video(inf)) {
-        fprintf(stderr, "Error: \"%s\" has no video data.\n", infile);
+    if(server_socket) {
+        retval = server_run(server_socket, &avs_h, keep, reimport, threads, &memory, nostderr) ? 1 : 0;
         goto fail;
     }
-    if(!avs_h.func.avs_component_size(inf)) {
-        fprintf(stderr, "Error: this program only works with Avisynth+.\n");
+    if(batch) {
+        retval = batch_run(batch, &avs_h, &req, batch_jobs, reimport, threads, &memory, report, nostderr) ? 1 : 0;
+        report = NULL; // batch_run wrote its own
         goto fail;
     }
-    /* if the clip is made of fields instead of frames, call weave to make them frames */
-    if(avs_is_field_based(inf)) {
+    const AVS_VideoInfo *inf;
+    pin_thread(1);
+    int mt = open_script(&avs_h, infile, &inf) ? -1 : threads ? set_threads(&avs_h, infile, &inf, threads) : 0;
+    pin_thread(0);
+    if(mt < 0)
+        goto fail;
+    set_memory(&avs_h, &memory);
+    layout.fields = alpha_layout.fields = field_mode(inf, fields);
+    if(layout.fields == FIELDS_WEAVE)
         fprintf(stderr, "Detected fieldbased (separated) input, weaving to frames.\n");
-        AVS_Value tmp = avs_h.func.avs_invoke(avs_h.env, "Weave", res, NULL);
-        if(avs_is_error(tmp)) {
-            fprintf(stderr, "Error: couldn't weave fields into frames.\n");
-            goto fail;
-        }
-        res = internal_avs_update_clip(&avs_h, &inf, tmp, res);
-        interlaced = 1;
-        tff = avs_is_tff(inf);
+    if(layout.fields == FIELDS_SEPARATE && inf->height & (avs_h.func.avs_is_420(inf) ? 3 : 1)) {
+        fprintf(stderr, "Error: -fields needs a height that is mod%d.\n", avs_h.func.avs_is_420(inf) ? 4 : 2);
+        goto fail;
     }
+    interlaced = layout.fields == FIELDS_WEAVE;
+    tff = avs_is_tff(inf);
+    AVS_VideoInfo fields_inf;
+    inf = output_info(inf, layout.fields, &fields_inf);
     if(!nostderr)
         fprintf(stderr, "%s\n", MY_VERSION);
     input_width  = inf->width;
     input_height = inf->height;
-    if(input_depth > 8 && (avs_h.func.avs_is_yv12(inf) || avs_h.func.avs_is_yv16(inf) || avs_h.func.avs_is_yv24(inf))) { //ignore native hbd cs
+    if(clip_is_hack(&avs_h, inf, input_depth)) {
         if(input_width & 3) {
             if(!nostderr)
                 fprintf(stderr, "Error: avisynth %d-bit hack requires that width is at least mod4.\n", input_depth);
             goto fail;
         }
+        if(format.stacked && input_height & 3) {
+            if(!nostderr)
+                fprintf(stderr, "Error: stacked %d-bit hack requires that height is at least mod4.\n", input_depth);
+            goto fail;
+        }
         if(!nostderr)
             fprintf(stderr, "Avisynth %d-bit hack enabled!\n", input_depth);
-        if(avs_h.func.avs_component_size(inf) == 1)
+        if(format.stacked)
+            input_height >>= 1;
+        else
             input_width >>= 1;
     }
     if(!fps_num || !fps_den) {
@@ -301,105 +3188,275 @@ add_outfile:
         else
             fprintf(stderr, "Frames per sec:\t%u/%u (%.3f)\n", fps_num, fps_den, (float) fps_num/fps_den);
         fprintf(stderr, "Total frames:\t%d\n", inf->num_frames);
+        if(mt)
+            fprintf(stderr, "Threads:\t%d (Prefetch)\n", threads);
+        else if(threads)
+            fprintf(stderr, "Threads:\tthe script already calls Prefetch, -threads ignored\n");
+        if(memory.memmax)
+            fprintf(stderr, "Cache limit:\t%d MiB per environment\n", memory.memmax);
     }
     signal(SIGINT, sigintHandler);
+    signal(SIGTERM, sigintHandler);
     //start processing
     i_start = avs2yuv_mdate();
     time_t tm_s = time(0);
     i_frame_total = inf->num_frames;
     if(b_ctrl_c)
         goto close_files;
-    avs_h.func.avs_release_value(res);
-    for(int i = 0; i < out_fhs; i++) {
-        if(!strcmp(outfile[i], "-")) {
-            for(int j = 0; j < i; j++)
-                if(out_fh[j] == stdout) {
-                    fprintf(stderr, "Error: can't write to stdout multiple times.\n");
-                    goto fail;
-                }
-            int dupout = dup(fileno(stdout));
-            fclose(stdout);
-            #if defined(AVS_WINDOWS)
-            _setmode(dupout, _O_BINARY);
-            #endif
-            out_fh[i] = fdopen(dupout, "wb");
-        } else {
-            out_fh[i] = fopen(outfile[i], "wb");
-            if(!out_fh[i]) {
-                fprintf(stderr, "Error: failed to create/open \"%s\".\n", outfile[i]);
-                goto fail;
-            }
-        }
+    int stdout_users = (alpha_out.name && !strcmp(alpha_out.name, "-")) + (audio.name && !strcmp(audio.name, "-"));
+    for(int i = 0; i < out_fhs; i++)
+        stdout_users += !strcmp(outputs[i].name, "-");
+    if(stdout_users > 1) {
+        fprintf(stderr, "Error: can't write to stdout multiple times.\n");
+        goto fail;
     }
     char *interlace_type = interlaced ? tff ? "t" : "b" : "p";
-    char csp_type[200];
-    int chroma_h_shift = 0;
-    int chroma_v_shift = 0;
-    if(avs_h.func.avs_is_y(inf)) {
-        if(input_depth == 16)
-            sprintf(csp_type, "Cmono16 XYSCSS=Cmono16");
-        else if(avs_h.func.avs_bits_per_component(inf) == 16)
-            sprintf(csp_type, "Cmono16 XYSCSS=Cmono16");
-        else if((avs_h.func.avs_bits_per_component(inf) > 8 && avs_h.func.avs_bits_per_component(inf) < 16) || (input_depth > 8 && input_depth < 16)) {
-            fprintf(stderr, "Warning: output bit-depth is forced to 16 (was %d)!\n", avs_h.func.avs_bits_per_component(inf));
-            sprintf(csp_type, "Cmono16 XYSCSS=Cmono16");
-        } else
-            sprintf(csp_type, "Cmono");
-    } else if(avs_h.func.avs_is_420(inf)) {
-        chroma_h_shift = 1;
-        chroma_v_shift = 1;
-        if(input_depth > 8)
-            sprintf(csp_type, "C420p%d XYSCSS=C420p%d", input_depth, input_depth);
-        else if(avs_h.func.avs_bits_per_component(inf) > 8)
-            sprintf(csp_type, "C420p%d XYSCSS=C420p%d", avs_h.func.avs_bits_per_component(inf), avs_h.func.avs_bits_per_component(inf));
-        else
-            sprintf(csp_type, "C420mpeg2");
-    } else if(avs_h.func.avs_is_422(inf)) {
-        chroma_h_shift = 1;
-        if(input_depth > 8)
-            sprintf(csp_type, "C422p%d XYSCSS=C422p%d", input_depth, input_depth);
-        else if(avs_h.func.avs_bits_per_component(inf) > 8)
-            sprintf(csp_type, "C422p%d XYSCSS=C422p%d", avs_h.func.avs_bits_per_component(inf), avs_h.func.avs_bits_per_component(inf));
-        else
-            sprintf(csp_type, "C422");
-    } else if(avs_h.func.avs_is_444(inf)) {
-        if(input_depth > 8)
-            sprintf(csp_type, "C444p%d XYSCSS=C444p%d", input_depth, input_depth);
-        else if(avs_h.func.avs_bits_per_component(inf) > 8)
-            sprintf(csp_type, "C444p%d XYSCSS=C444p%d", avs_h.func.avs_bits_per_component(inf), avs_h.func.avs_bits_per_component(inf));
+    char csp_type[200] = "";
+    const char *format_error = clip_format(&avs_h, inf, input_depth, &format, raw_output, 0, csp_type, &layout);
+    if(format_error) {
+        fprintf(stderr, "Error: %s.\n", format_error);
+        goto fail;
+    }
+    char alpha_csp[200] = "";
+    if(alpha_out.name && (format_error = clip_format(&avs_h, inf, input_depth, &format, !alpha_out.y4m_header, 1, alpha_csp, &alpha_layout))) {
+        fprintf(stderr, "Error: -alpha: %s.\n", format_error);
+        goto fail;
+    }
+    for(int i = 0; i < out_fhs && layout.converted; i++)
+        if(!strncmp(outputs[i].name, "avz:", 4)) {
+            fprintf(stderr, "Error: avz: outputs keep the clip as it is, they can't be used with a conversion.\n");
+            goto fail;
+        }
+    if(layout.converted && !nostderr) {
+        const convert_t *c = &layout.conv;
+        static const char *pack_names[] = {"planar", "P010", "P016", "v210"};
+        if(c->src_bytes == 4)
+            fprintf(stderr, "Conversion:\tfloat to %d bits%s, %s range, %s (%s)\n", c->dst_bits, c->dither ? " dithered" : "",
+                    format.limited ? "limited" : "full", pack_names[c->pack], c->k->name);
         else
-            sprintf(csp_type, "C444");
-    } else {
-        if(!raw_output) {
-            fprintf(stderr, "Error: unsupported colorspace.\nYou still can output any format in headerless mode. Use \"-raw\" option if you really need that.\n");
+            fprintf(stderr, "Conversion:\t%d to %d bits%s, %s%s (%s)\n", c->src_bits, c->dst_bits, c->dither ? " dithered" : "",
+                    pack_names[c->pack], c->stacked ? " from stacked" : "", c->k->name);
+    }
+    if(!csp_type[0] && !raw_output) {
+        fprintf(stderr, "Error: unsupported colorspace.\nYou still can output any format in headerless mode. Use \"-raw\" option if you really need that.\n");
+        goto fail;
+    }
+    int64_t frame_size = layout.frame_size;
+    int64_t write_target = out_fhs * frame_size; // how many bytes per frame we expect to write
+    if(ranges) {
+        if(schedule_fit(&sched, inf->num_frames))
             goto fail;
+        i_frame_total = sched.frames;
+        if(!nostderr)
+            fprintf(stderr, "Ranges:\t\t%d (%d frames)\n", sched.count, sched.frames);
+    } else if(!slave) {
+        end += seek;
+        if(end <= seek || end > inf->num_frames)
+            end = inf->num_frames;
+        whole.first = seek;
+        whole.end = end;
+        sched.range = &whole;
+        sched.count = 1;
+        sched.frames = end > seek ? end - seek : 0;
+    }
+    shm_ring_header_t desc = {.width = input_width, .height = input_height, .fps_num = fps_num, .fps_den = fps_den,
+                              .par_width = par_width, .par_height = par_height, .num_frames = inf->num_frames, .interlace = *interlace_type};
+    snprintf(desc.csp, sizeof(desc.csp), "%s", csp_type);
+    char header[400];
+    int header_len = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%u:%u I%s A%u:%u %s\n", input_width, input_height, fps_num, fps_den, interlace_type, par_width, par_height, csp_type);
+    if(alpha_out.name) {
+        char alpha_header[400];
+        int alpha_header_len = snprintf(alpha_header, sizeof(alpha_header), "YUV4MPEG2 W%d H%d F%u:%u I%s A%u:%u %s\n", inf->width, inf->height,
+                                        fps_num, fps_den, interlace_type, par_width, par_height, alpha_csp);
+        if(alpha_layout.converted && !strncmp(alpha_out.name, "avz:", 4)) {
+            fprintf(stderr, "Error: avz: outputs keep the clip as it is, they can't be used with a conversion.\n");
+            goto fail;
+        }
+        if(output_start(&alpha_out, &alpha_layout, alpha_header, alpha_header_len, &desc))
+            goto fail;
+        if(!nostderr)
+            fprintf(stderr, "Alpha:\t\t%s\n", alpha_out.name);
+    }
+    if(audio.name) {
+        if(audio_start(&audio, &avs_h, inf, &sched))
+            goto fail;
+        if(!nostderr)
+            fprintf(stderr, "Audio:\t\t%s, %d Hz, %d channels, %s%d bits%s\n", audio.name, inf->audio_samples_per_second, inf->nchannels,
+                    inf->sample_type == AVS_SAMPLE_FLOAT ? "float " : "", audio.sample_size * 8, audio.raw ? ", raw" : "");
+    }
+    if(stats.name) {
+        if(stats_open(&stats, &avs_h, inf, infile))
+            goto fail;
+        if(!nostderr)
+            fprintf(stderr, "Stats:\t\t%s (%s)\n", stats.name, stats.k->name);
+    }
+    if(hash.name || hash.compare) {
+        if(hash_open(&hash, &avs_h, inf))
+            goto fail;
+        if(!nostderr)
+            fprintf(stderr, "Hash:\t\t%s%s%s%s (CRC32C, %s)\n", hash.name ? hash.name : "", hash.name && hash.compare ? ", " : "",
+                    hash.compare ? "checked against " : "", hash.compare ? hash.compare : "", hash.kernel);
+    }
+    if(manifest_path && !(manifest = fopen(manifest_path, "w"))) {
+        fprintf(stderr, "Error: failed to create manifest \"%s\".\n", manifest_path);
+        goto fail;
+    }
+    if(checkpoint_path) {
+        snprintf(checkpoint.script, sizeof(checkpoint.script), "%s", infile);
+        checkpoint.frame_size = frame_size;
+        checkpoint.first = sched.range[0].first;
+        checkpoint.total = sched.frames;
+        checkpoint_t old;
+        int found = resume ? checkpoint_read(checkpoint_path, &old) : 1;
+        if(found < 0)
+            goto fail;
+        if(!found) {
+            if(strcmp(old.script, checkpoint.script) || old.frame_size != checkpoint.frame_size ||
+               old.first != checkpoint.first || old.total != checkpoint.total) {
+                fprintf(stderr, "Error: checkpoint \"%s\" belongs to a different script, format or range.\n", checkpoint_path);
+                goto fail;
+            }
+            for(int i = 0; i < out_fhs; i++)
+                if(output_resume(&outputs[i], header, header_len, frame_size, old.frames))
+                    goto fail;
+            checkpoint.frames = old.frames;
+            schedule_skip(&sched, old.frames);
+            if(ranges)
+                i_frame_total = sched.frames;
+            if(!nostderr)
+                fprintf(stderr, "Resuming:\t%d frames already done, %d to go\n", old.frames, sched.frames);
         }
+        checkpoint_ready = 1;
+        checkpoint_time = avs2yuv_mdate();
     }
     for(int i = 0; i < out_fhs; i++) {
-        if(setvbuf(out_fh[i], NULL, _IOFBF, AVS_BUFSIZE)) {
-            fprintf(stderr, "Error: failed to create buffer for \"%s\".\n", outfile[i]);
+        if(!outputs[i].name_template)
+            outputs[i].expect = (outputs[i].y4m_header ? header_len : 0) + sched.frames * (frame_size + (outputs[i].y4m_header ? 6 : 0));
+        if(outputs[i].name_template ? output_next_file(&outputs[i], &layout, sched.range[0].first, header, header_len, &desc) :
+                                      output_start(&outputs[i], &layout, header, header_len, &desc))
+            goto fail;
+    }
+    if(cache_mb && !slave)
+        fprintf(stderr, "Warning: -cache only applies to -slave and -slave2.\n");
+    else if(cache_mb) {
+        cache = &frame_cache;
+        if(frame_cache_init(cache, &layout, inf->num_frames, (int64_t)cache_mb * 1024 * 1024, readahead)) {
+            fprintf(stderr, "Error: failed to set up a %d MiB frame cache.\n", cache_mb);
             goto fail;
         }
-        if(!y4m_headers[i])
-            continue;
-        fprintf(out_fh[i], "YUV4MPEG2 W%d H%d F%u:%u I%s A%u:%u %s\n", input_width, input_height, fps_num, fps_den, interlace_type, par_width, par_height, csp_type);
-        fflush(out_fh[i]);
-    }
-    int frame_size = (inf->width * avs_h.func.avs_component_size(inf)) * inf->height + (avs_h.func.avs_num_components(inf) - 1) * ((inf->width * avs_h.func.avs_component_size(inf)) >> chroma_h_shift) * (inf->height >> chroma_v_shift);
-    int write_target = out_fhs * frame_size; // how many bytes per frame we expect to write
-    if(slave) {
-        seek = 0;
-        end = INT_MAX;
+        if(!nostderr)
+            fprintf(stderr, "Cache:\t\t%d frames (%d MiB), read-ahead %d\n", cache->capacity, cache_mb, cache->readahead);
+    }
+    if(slave == 2) {
+        if(shm_name) {
+            if(shm_ring_create(&ring, shm_name, shm_slots, frame_size)) {
+                fprintf(stderr, "Error: failed to create shared memory ring \"%s\".\n", shm_name);
+                goto fail;
+            }
+            shm_ring_describe(&ring, &desc);
+        }
+        slave2_info_t info = {SLAVE2_INFO_MAGIC, SLAVE2_VERSION, input_width, input_height, fps_num, fps_den, par_width, par_height, inf->num_frames, *interlace_type};
+        info.ring_slots = ring.hdr ? shm_slots : 0;
+        info.frame_size = frame_size;
+        snprintf(info.csp, sizeof(info.csp), "%s", csp_type);
+        for(int i = 0; i < out_fhs; i++)
+            if(output_write(&outputs[i], &info, sizeof(info)) != sizeof(info)) {
+                fprintf(stderr, "Error: failed to write to \"%s\".\n", outputs[i].name);
+                goto fail;
+            }
+        #if defined(AVS_WINDOWS)
+        SetConsoleTitle("avs2yuv: slave process running");
+        #endif
+        pin_thread(1); // renders on this thread
+        if(slave2_serve(&layout, inf->num_frames, outputs, out_fhs, ring.hdr ? &ring : NULL, cache))
+            goto fail;
+        goto close_files;
+    } else if(slave) {
         #if defined(AVS_WINDOWS)
         SetConsoleTitle("avs2yuv: slave process running");
         #endif
     } else {
-        end += seek;
-        if(end <= seek || end > inf->num_frames)
-            end = inf->num_frames;
+        for(int i = 0; i < out_fhs; i++)
+            if(outputs[i].lag)
+                threaded_writers = 1;
+        if(threaded_writers) {
+            for(int i = 0; i < out_fhs; i++)
+                if(writer_start(&writers[i], &outputs[i], &layout)) {
+                    fprintf(stderr, "Error: failed to start writer thread for \"%s\".\n", outputs[i].name);
+                    goto fail;
+                }
+        }
+        if(parallel > 1 || prefetch) {
+            int workers = parallel > 1 ? parallel : 1;
+            int depth = parallel > 1 && chunk > prefetch ? chunk : prefetch;
+            if(!nostderr) {
+                if(parallel > 1)
+                    fprintf(stderr, "Parallel:\t%d environments, %d-frame chunks, %d preroll (up to %.1f MiB queued)\n", workers, chunk, preroll, (double)workers * depth * frame_size / (1024 * 1024));
+                else
+                    fprintf(stderr, "Prefetch:\t%d frames (%.1f MiB)\n", prefetch, (double)prefetch * frame_size / (1024 * 1024));
+            }
+            pf = calloc(workers, sizeof(prefetch_t));
+            if(!pf)
+                goto fail;
+            pf_count = workers;
+            for(int w = 0; w < pf_count; w++) {
+                if(parallel > 1) {
+                    pf[w].chunk = chunk;
+                    pf[w].preroll = preroll;
+                    pf[w].index = w;
+                    pf[w].workers = pf_count;
+                    pf[w].threads = threads;
+                    pf[w].memory = &memory;
+                }
+                // the first worker reuses the environment that is already open
+                pf[w].render = !w && audio.name ? &audio_render : NULL;
+                if(prefetch_start(&pf[w], &avs_h, w ? infile : NULL, layout.fields, depth, &sched)) {
+                    fprintf(stderr, "Error: failed to start render thread.\n");
+                    goto fail;
+                }
+            }
+        }
     }
-    for(int frm = seek; frm < end; ++frm) {
-        if(slave) {
+    if(bench == BENCH_COPY && !(bench_buf = malloc(frame_size)))
+        goto fail;
+    if(!pf)
+        pin_thread(1); // this thread renders the frames itself
+    int64_t bench_start = avs2yuv_mdate();
+    for(int pos = 0; slave || pos < sched.frames; pos++) {
+        if(b_ctrl_c)
+            break;
+        int64_t t_stage = bench ? avs2yuv_mdate() : 0;
+        int frm = 0;
+        if(!slave) {
+            // templated outputs move on to a new file with every range and segment
+            int next_file = 0;
+            if(pos == sched.range[range].pos + sched.range[range].end - sched.range[range].first) {
+                range++;
+                next_file = 1;
+            }
+            frm = sched.range[range].first + pos - sched.range[range].pos;
+            if(segment_frames && (segment_frames == segment || (cuts.count && schedule_starts_at(&cuts, frm))))
+                next_file = 1;
+            if(next_file)
+                segment_frames = 0;
+            segment_frames++;
+            for(int i = 0; i < out_fhs; i++) {
+                if(!outputs[i].name_template)
+                    continue;
+                if(next_file) {
+                    if(threaded_writers && writer_stop(&writers[i], 1))
+                        goto fail;
+                    if(output_end_file(&outputs[i], &layout, manifest) ||
+                       output_next_file(&outputs[i], &layout, frm, header, header_len, &desc))
+                        goto fail;
+                    if(threaded_writers && writer_start(&writers[i], &outputs[i], &layout)) {
+                        fprintf(stderr, "Error: failed to start writer thread for \"%s\".\n", outputs[i].name);
+                        goto fail;
+                    }
+                }
+                outputs[i].file_last = frm;
+            }
+        } else {
             char input[80];
             frm = -1;
             do {
@@ -410,54 +3467,98 @@ add_outfile:
             if(frm >= inf->num_frames)
                 frm = inf->num_frames-1;
         }
-        AVS_VideoFrame *f = avs_h.func.avs_get_frame(avs_h.clip, frm);
-        const char *err = avs_h.func.avs_clip_get_error(avs_h.clip);
-        if(err) {
-            fprintf(stderr, "Error: %s occurred while reading frame %d.\n", err, frm);
+        frame_t f = {NULL};
+        cache_entry_t *e = NULL;
+        prefetch_t *src = pf ? &pf[(pos / pf[0].chunk) % pf_count] : NULL;
+        if(cache) {
+            const char *err;
+            int64_t start = avs2yuv_mdate();
+            e = frame_cache_get(cache, frm, &err);
+            latency_add(&wait_latency, avs2yuv_mdate() - start, frm);
+            if(!e) {
+                fprintf(stderr, "Error: %s occurred while reading frame %d.\n", err, frm);
+                goto fail;
+            }
+        } else if(src) {
+            int64_t start = avs2yuv_mdate();
+            f = frame_queue_pop(&src->queue);
+            latency_add(&wait_latency, avs2yuv_mdate() - start, frm);
+            if(!f.frame)
+                goto fail;
+        } else {
+            if(audio.name)
+                pthread_mutex_lock(&audio_render);
+            f = render_frame(&avs_h, layout.fields, frm);
+            const char *err = avs_h.func.avs_clip_get_error(avs_h.clip);
+            if(audio.name)
+                pthread_mutex_unlock(&audio_render);
+            if(err) {
+                fprintf(stderr, "Error: %s occurred while reading frame %d.\n", err, frm);
+                goto fail;
+            }
+        }
+        if(bench) {
+            int64_t t = avs2yuv_mdate();
+            bench_stage[STAGE_RENDER] += t - t_stage;
+            t_stage = t;
+        }
+        if(stats.name && stats_frame(&stats, f, pos, frm)) {
+            fprintf(stderr, "Error: failed to write to \"%s\".\n", stats.name);
+            frame_release(&avs_h, f);
             goto fail;
         }
-        if(out_fhs) {
-            static const int planes[] = {AVS_PLANAR_Y, AVS_PLANAR_U, AVS_PLANAR_V};
-            int wrote = 0;
+        if((hash.name || hash.compare) && hash_frame(&hash, f, pos, frm)) {
+            frame_release(&avs_h, f);
+            goto fail;
+        }
+        if(bench == BENCH_COPY) {
+            pack_frame(&layout, f, bench_buf);
+            int64_t t = avs2yuv_mdate();
+            bench_stage[STAGE_COPY] += t - t_stage;
+            t_stage = t;
+        }
+        if(threaded_writers) {
+            int64_t start = avs2yuv_mdate();
             for(int i = 0; i < out_fhs; i++)
-                if(y4m_headers[i])
-                    fwrite("FRAME\n", 1, 6, out_fh[i]);
-            for(int p = 0; p < avs_h.func.avs_num_components(inf); p++) {
-                int w = (inf->width * avs_h.func.avs_component_size(inf)) >> (p ? chroma_h_shift : 0);
-                int h = inf->height >> (p ? chroma_v_shift : 0);
-                int pitch = avs_h.func.avs_get_pitch_p(f, planes[p]);
-                const BYTE* data = avs_h.func.avs_get_read_ptr_p(f, planes[p]);
-                for(int y = 0; y < h; y++) {
-                    for(int i = 0; i < out_fhs; i++)
-                        wrote += fwrite(data, 1, w, out_fh[i]);
-                    data += pitch;
+                if(writer_push(&writers[i], f)) {
+                    frame_release(&avs_h, f);
+                    goto fail;
                 }
-            }
+            latency_add(&push_latency, avs2yuv_mdate() - start, frm);
+        } else if(out_fhs) {
+            int64_t wrote = 0;
+            for(int i = 0; i < out_fhs; i++)
+                wrote += e ? write_packed(&outputs[i], &layout, e->data) : write_frame(&outputs[i], &layout, f);
+            if(e)
+                frame_cache_put(cache, e);
             if(wrote != write_target) {
-                fprintf(stderr, "Error: wrote only %d of %d bytes.\n", wrote, write_target);
+                fprintf(stderr, "Error: wrote only %"PRId64" of %"PRId64" bytes.\n", wrote, write_target);
                 goto fail;
             }
-            if(slave) { // assume timing doesn't matter in other modes
-                for(int i = 0; i < out_fhs; i++)
-                    fflush(out_fh[i]);
-            }
         }
+        if(alpha_out.name && write_frame(&alpha_out, &alpha_layout, f) != alpha_layout.frame_size) {
+            fprintf(stderr, "Error: failed to write to \"%s\".\n", alpha_out.name);
+            goto fail;
+        }
+        if(bench == BENCH_WRITE)
+            bench_stage[STAGE_WRITE] += avs2yuv_mdate() - t_stage;
         #if defined(AVS_WINDOWS)
         if(frm == 0) {
             SetConsoleTitle("avs2yuv: executing script");
         }
         #endif
-        if(!nostderr) {
+        if(!nostderr && !bench) {
             char buf[400];
+            int shown = ranges ? pos : frm; // with -ranges, progress goes by position in the output
             int64_t i_time = avs2yuv_mdate();
             int64_t i_elapsed = i_time - i_start;
-            double fps = i_elapsed > 0 ? frm * 1000000. / i_elapsed : 0;
-            i_frame = frm + 1;
+            double fps = i_elapsed > 0 ? shown * 1000000. / i_elapsed : 0;
+            i_frame = shown + 1;
             int secs = i_elapsed / 1000000;
             int eta = i_elapsed * (i_frame_total - i_frame) / ((int64_t)i_frame * 1000000);
             if(!nostderr) {
                 #if defined(AVS_WINDOWS)
-                sprintf(buf, "avs2yuv [%.1f%%], %d/%d frames, %.2f fps, eta %d:%02d:%02d", 100. * frm / i_frame_total, frm, (int)i_frame_total, fps, eta / 3600, (eta / 60) % 60, eta % 60);
+                sprintf(buf, "avs2yuv [%.1f%%], %d/%d frames, %.2f fps, eta %d:%02d:%02d", 100. * shown / i_frame_total, shown, (int)i_frame_total, fps, eta / 3600, (eta / 60) % 60, eta % 60);
                 SetConsoleTitle(buf);
                 #endif
                 static int print_progress_header = 1;
@@ -465,15 +3566,46 @@ add_outfile:
                     fprintf(stderr, "%6s %12s   %7s %9s %9s\n", "Progress", "Frames", "FPS", "Elapsed", "Remain");
                     print_progress_header = 0;
                 }
-                sprintf(buf, "[%5.1f%%] %6d/%-6d %8.2f %3d:%02d:%02d %3d:%02d:%02d", 100. * frm / i_frame_total, frm, (int)i_frame_total, fps, secs / 3600, (secs / 60) % 60, secs % 60, eta / 3600, (eta / 60) % 60, eta % 60);
+                sprintf(buf, "[%5.1f%%] %6d/%-6d %8.2f %3d:%02d:%02d %3d:%02d:%02d", 100. * shown / i_frame_total, shown, (int)i_frame_total, fps, secs / 3600, (secs / 60) % 60, secs % 60, eta / 3600, (eta / 60) % 60, eta % 60);
                 fprintf(stderr, "%s   \r", buf);
             }
             fflush(stderr);
         }
-        avs_h.func.avs_release_video_frame(f);
+        frame_release(&avs_h, f);
+        if(src)
+            frame_queue_release(&src->queue);
+        frames_done++;
+        if(audio.name && audio_advance(&audio, pos + 1))
+            goto fail;
+        if(checkpoint_ready && avs2yuv_mdate() - checkpoint_time >= CHECKPOINT_INTERVAL) {
+            if(checkpoint_write(checkpoint_path, &checkpoint, outputs, out_fhs))
+                goto fail;
+            checkpoint_time = avs2yuv_mdate();
+        }
     }
+    int64_t t_drain = avs2yuv_mdate();
+    for(int i = 0; i < out_fhs; i++)
+        if(writer_stop(&writers[i], 1))
+            goto fail;
+    for(int i = 0; i < out_fhs; i++)
+        if(outputs[i].name_template && frames_done && output_end_file(&outputs[i], &layout, manifest))
+            goto fail;
     for(int i = 0; i < out_fhs; i++)
-        fflush(out_fh[i]);
+        if(output_finish(&outputs[i]))
+            goto fail;
+    if(alpha_out.name && output_finish(&alpha_out))
+        goto fail;
+    if(audio.name && audio_finish(&audio, 0))
+        goto fail;
+    if(stats.name && stats_close(&stats))
+        goto fail;
+    if((hash.name || hash.compare) && hash_close(&hash, !b_ctrl_c))
+        goto fail;
+    if(bench) {
+        int64_t t = avs2yuv_mdate();
+        bench_stage[STAGE_WRITE] += t - t_drain;
+        bench_report(bench, frames_done, frame_size, bench_stage, t - bench_start);
+    }
 close_files:
     retval = 0;
     if(!nostderr) {
@@ -483,11 +3615,50 @@ close_files:
         fprintf(stderr, "Finished:\t%s", ctime(&tm2));
         tm2 = tm2 - tm_s;
         fprintf(stderr, "Elapsed:\t%d:%02d:%02d\n", (int)tm2 / 3600, (int)tm2 % 3600 / 60, (int)tm2 % 60);
+        if(cache)
+            fprintf(stderr, "Cache:\t\t%"PRId64" hits, %"PRId64" misses, %"PRId64" frames read ahead\n", cache->hits, cache->misses, cache->read_ahead);
+        int64_t rss = peak_rss_kib();
+        fprintf(stderr, "Memory:\t\t");
+        if(rss)
+            fprintf(stderr, "peak RSS %.1f MiB, ", rss / 1024.);
+        fprintf(stderr, "AviSynth cache limit %d MiB\n", avs_h.func.avs_set_memory_max(avs_h.env, 0));
+        if(stats.name)
+            fprintf(stderr, "Scene cuts:\t%d\n", stats.cut_count);
+        if(hash.name || hash.compare)
+            fprintf(stderr, "Digest:\t\t%08"PRIx32" over %d frames%s%s%s\n", hash.digest, hash.frames,
+                    hash.compare ? b_ctrl_c ? ", identical so far to \"" : ", identical to \"" : "", hash.compare ? hash.compare : "", hash.compare ? "\"" : "");
     }
 fail:
+    audio_finish(&audio, 1);
+    stats_close(&stats);
+    hash_close(&hash, 0);
+    for(int w = 0; w < pf_count; w++)
+        prefetch_stop(&pf[w]);
+    free(pf);
+    free(bench_buf);
+    if(ranges)
+        free(sched.range);
+    free(cuts.range);
+    if(manifest && fclose(manifest) && !retval) {
+        fprintf(stderr, "Error: failed to write to the manifest.\n");
+        retval = 1;
+    }
+    if(cache)
+        frame_cache_free(cache);
+    for(int i = 0; i < out_fhs; i++)
+        writer_stop(&writers[i], 0);
+    if(checkpoint_ready && checkpoint_write(checkpoint_path, &checkpoint, outputs, out_fhs) && !retval)
+        retval = 1;
+    if(report && write_report(report, infile, retval ? "error" : b_ctrl_c ? "interrupted" : "ok", frames_done,
+                              i_start ? avs2yuv_mdate() - i_start : 0, &wait_latency, &push_latency, outputs, out_fhs,
+                              avs_h.env ? avs_h.func.avs_set_memory_max(avs_h.env, 0) : 0) && !retval)
+        retval = 1;
+    shm_ring_close(&ring);
+    shm_ring_unlink(&ring);
     for(int i = 0; i < out_fhs; i++)
-        if(out_fh[i])
-            fclose(out_fh[i]);
+        output_close(&outputs[i], &layout, !retval);
+    if(alpha_out.name)
+        output_close(&alpha_out, &alpha_layout, !retval);
     if(avs_h.library)
         internal_avs_close_library(&avs_h);
     return retval;
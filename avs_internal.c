@@ -143,6 +143,8 @@ typedef struct
         AVSC_DECLARE_FUNC(avs_num_components);
         AVSC_DECLARE_FUNC(avs_component_size);
         AVSC_DECLARE_FUNC(avs_bits_per_component);
+
+        AVSC_DECLARE_FUNC(avs_get_env_property);
     } func;
 } avs_hnd_t;
 
@@ -231,6 +233,8 @@ static int internal_avs_load_library(avs_hnd_t *h)
     LOAD_AVS_FUNC(avs_num_components, 0);
     LOAD_AVS_FUNC(avs_component_size, 0);
     LOAD_AVS_FUNC(avs_bits_per_component, 0);
+
+    LOAD_AVS_FUNC(avs_get_env_property, 1);
     return 0;
 fail:
     avs_close(h->library);
@@ -0,0 +1,694 @@
+/*****************************************************************************
+ * avz.c: lossless intermediate codec and container (avz:PATH outputs, -avzread)
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *****************************************************************************/
+
+/* An avz file holds, in native byte order,
+ *
+ *   avz_header_t                               the frame geometry and the y4m header line
+ *   frame 0: avz_frame_t, avz_slice_t[slices], slice data
+ *   frame 1: ...
+ *   index:   "AVZI", uint32 count, uint64 offset of every frame
+ *
+ * index_offset and frames are filled into the header once the file is finished. A file
+ * whose writer died has neither and is read by walking the frame headers instead.
+ *
+ * Every plane is cut into up to AVZ_BANDS horizontal slices that are coded on their own.
+ * A slice takes whichever of the left, gradient and median predictors does best on a
+ * sample of its rows; the residuals are Rice coded with the parameter adapted per context,
+ * the context being the local gradient. Samples are bytes or 16-bit words. Slices that
+ * don't get smaller are stored. Frames are compressed on a pool of worker threads and
+ * written in order by the thread that hands them in. */
+
+#define AVZ_MAGIC "AVS2YUVZ"
+#define AVZ_VERSION 1
+#define AVZ_FRAME_MAGIC 0x465a5641 // "AVZF"
+#define AVZ_INDEX_MAGIC 0x495a5641 // "AVZI"
+#define AVZ_BANDS 4
+#define AVZ_MAX_SLICES (4 * AVZ_BANDS)
+#define AVZ_CONTEXTS 16
+#define AVZ_LIMIT 24            // longest unary prefix before a residual is escaped
+
+enum { AVZ_STORED, AVZ_LEFT, AVZ_GRADIENT, AVZ_MEDIAN };
+
+typedef struct {
+    char magic[8];              // AVZ_MAGIC
+    uint32_t version;           // AVZ_VERSION
+    uint32_t header_size;
+    uint64_t index_offset;      // 0 until the file is finished
+    uint32_t frames;            // 0 until the file is finished
+    uint32_t planes;
+    uint32_t sample_size;       // 1 or 2 bytes
+    uint32_t row_size[4];       // bytes
+    uint32_t height[4];
+    char y4m[404];              // y4m header line including the newline, for decoding
+} avz_header_t;
+
+typedef struct {
+    uint32_t magic;             // AVZ_FRAME_MAGIC
+    uint32_t size;              // bytes following this header
+    uint32_t slices;
+    uint32_t reserved;
+} avz_frame_t;
+
+typedef struct {
+    uint32_t size;              // bytes of slice data
+    uint8_t plane;
+    uint8_t predictor;
+    uint16_t reserved;
+    uint32_t first_row;
+    uint32_t rows;
+} avz_slice_t;
+
+typedef struct {
+    uint32_t a;                 // sum of recent residuals
+    uint32_t n;                 // and their count
+} avz_context_t;
+
+typedef struct {
+    uint8_t *p;
+    uint64_t acc;
+    int n;
+} avz_bitwriter_t;
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    uint64_t acc;
+    int n;
+} avz_bitreader_t;
+
+/* per thread buffers for one row of the widest plane */
+typedef struct {
+    uint16_t *row[2];
+    uint16_t *res;
+} avz_scratch_t;
+
+typedef struct {
+    int planes;
+    int sample_size;
+    int row_size[4];
+    int height[4];
+    int width[4];               // samples per row
+    int bits;                   // 8 or 16
+    size_t max_frame;           // bound of a compressed frame
+} avz_geometry_t;
+
+static inline void avz_put(avz_bitwriter_t *b, uint32_t v, int n)
+{
+    b->acc = (b->acc << n) | v;
+    b->n += n;
+    while(b->n >= 8) {
+        b->n -= 8;
+        *b->p++ = b->acc >> b->n;
+    }
+}
+
+static inline void avz_fill(avz_bitreader_t *b)
+{
+    while(b->n <= 56) {
+        b->acc = (b->acc << 8) | (b->p < b->end ? *b->p : 0);
+        b->p++; // runs past the end on broken data, which the caller checks
+        b->n += 8;
+    }
+}
+
+static inline uint32_t avz_get(avz_bitreader_t *b, int n)
+{
+    b->n -= n;
+    return (b->acc >> b->n) & (((uint64_t)1 << n) - 1);
+}
+
+static inline int avz_k(const avz_context_t *c)
+{
+    int k = 0;
+    while((c->n << k) < c->a && k < 16)
+        k++;
+    return k;
+}
+
+static inline void avz_adapt(avz_context_t *c, uint32_t u)
+{
+    c->a += u;
+    if(++c->n == 64) {
+        c->a >>= 1;
+        c->n >>= 1;
+    }
+}
+
+static inline int avz_context(int a, int b, int c)
+{
+    int act = abs(a - c) + abs(b - c);
+    int ctx = act ? 32 - __builtin_clz(act) : 0;
+    return ctx < AVZ_CONTEXTS ? ctx : AVZ_CONTEXTS - 1;
+}
+
+/* wraps the prediction error to the sample width and folds it to an unsigned value */
+static inline uint16_t avz_zigzag(int d, int bits)
+{
+    int s = (int)((unsigned)d << (32 - bits)) >> (32 - bits);
+    return s >= 0 ? 2 * s : -2 * s - 1;
+}
+
+static inline int avz_unzigzag(uint32_t u)
+{
+    return u & 1 ? -(int)(u >> 1) - 1 : (int)(u >> 1);
+}
+
+static inline int avz_median(int a, int b, int c)
+{
+    int lo = a < b ? a : b;
+    int hi = a < b ? b : a;
+    return c >= hi ? lo : c <= lo ? hi : a + b - c;
+}
+
+/* residuals of a row below 'top'; kept free of dependencies between samples so that the
+ * compiler turns the loops into SIMD code */
+static void avz_residuals(const uint16_t *restrict cur, const uint16_t *restrict top, int w, int predictor, int bits, uint16_t *restrict res)
+{
+    res[0] = avz_zigzag(cur[0] - top[0], bits);
+    if(predictor == AVZ_LEFT)
+        for(int x = 1; x < w; x++)
+            res[x] = avz_zigzag(cur[x] - cur[x-1], bits);
+    else if(predictor == AVZ_GRADIENT)
+        for(int x = 1; x < w; x++)
+            res[x] = avz_zigzag(cur[x] - (cur[x-1] + top[x] - top[x-1]), bits);
+    else
+        for(int x = 1; x < w; x++)
+            res[x] = avz_zigzag(cur[x] - avz_median(cur[x-1], top[x], top[x-1]), bits);
+}
+
+/* loads a row as 16-bit samples */
+static void avz_load_row(uint16_t *dst, const BYTE *src, int w, int sample_size)
+{
+    if(sample_size == 2)
+        memcpy(dst, src, w * 2);
+    else
+        for(int x = 0; x < w; x++)
+            dst[x] = src[x];
+}
+
+static void avz_store_row(BYTE *dst, const uint16_t *src, int w, int sample_size)
+{
+    if(sample_size == 2)
+        memcpy(dst, src, w * 2);
+    else
+        for(int x = 0; x < w; x++)
+            dst[x] = src[x];
+}
+
+static void avz_code_row(avz_bitwriter_t *b, avz_context_t *ctx, const uint16_t *cur, const uint16_t *top, const uint16_t *res, int w, int bits)
+{
+    for(int x = 0; x < w; x++) {
+        avz_context_t *c = &ctx[top && x ? avz_context(cur[x-1], top[x], top[x-1]) : 0];
+        int k = avz_k(c);
+        uint32_t u = res[x];
+        uint32_t q = u >> k;
+        if(q < AVZ_LIMIT) {
+            avz_put(b, 1, q + 1);
+            avz_put(b, u & ((1 << k) - 1), k);
+        } else {
+            avz_put(b, 0, AVZ_LIMIT);
+            avz_put(b, u, bits);
+        }
+        avz_adapt(c, u);
+    }
+}
+
+static void avz_geometry(avz_geometry_t *g, const avz_header_t *h)
+{
+    g->planes = h->planes;
+    g->sample_size = h->sample_size;
+    g->bits = h->sample_size == 1 ? 8 : 16;
+    g->max_frame = sizeof(avz_frame_t) + AVZ_MAX_SLICES * sizeof(avz_slice_t);
+    for(int p = 0; p < g->planes; p++) {
+        g->row_size[p] = h->row_size[p];
+        g->height[p] = h->height[p];
+        g->width[p] = h->row_size[p] / h->sample_size;
+        // a slice is given up for stored once it outgrows its raw size, which it can
+        // only overshoot by one row of escaped residuals
+        g->max_frame += (size_t)g->row_size[p] * g->height[p] + AVZ_BANDS * ((size_t)g->width[p] * 5 + 16);
+    }
+}
+
+static int avz_scratch_init(avz_scratch_t *s, const avz_geometry_t *g)
+{
+    int w = 0;
+    for(int p = 0; p < g->planes; p++)
+        if(g->width[p] > w)
+            w = g->width[p];
+    s->row[0] = malloc(w * sizeof(uint16_t));
+    s->row[1] = malloc(w * sizeof(uint16_t));
+    s->res = malloc(w * sizeof(uint16_t));
+    return s->row[0] && s->row[1] && s->res ? 0 : -1;
+}
+
+static void avz_scratch_free(avz_scratch_t *s)
+{
+    free(s->row[0]);
+    free(s->row[1]);
+    free(s->res);
+}
+
+/* picks a predictor from every fourth row of the slice */
+static int avz_choose(avz_scratch_t *s, const plane_rows_t *src, int first, int rows, int w, int sample_size, int bits)
+{
+    uint64_t cost[4] = {0};
+    for(int y = 1; y < rows; y += 4) {
+        avz_load_row(s->row[0], plane_row(src, first + y - 1), w, sample_size);
+        avz_load_row(s->row[1], plane_row(src, first + y), w, sample_size);
+        for(int p = AVZ_LEFT; p <= AVZ_MEDIAN; p++) {
+            avz_residuals(s->row[1], s->row[0], w, p, bits, s->res);
+            for(int x = 0; x < w; x++)
+                cost[p] += s->res[x];
+        }
+    }
+    int best = AVZ_MEDIAN;
+    for(int p = AVZ_LEFT; p < AVZ_MEDIAN; p++)
+        if(cost[p] < cost[best])
+            best = p;
+    return best;
+}
+
+/* compresses 'rows' rows of a plane from row 'first' on into dst; returns the slice size */
+static uint32_t avz_encode_slice(avz_scratch_t *s, const avz_geometry_t *g, int plane, const plane_rows_t *src, int first, int rows, uint8_t *dst, int *predictor)
+{
+    int w = g->width[plane];
+    size_t raw = (size_t)g->row_size[plane] * rows;
+    avz_context_t ctx[AVZ_CONTEXTS];
+    for(int i = 0; i < AVZ_CONTEXTS; i++)
+        ctx[i] = (avz_context_t){16, 1};
+    *predictor = avz_choose(s, src, first, rows, w, g->sample_size, g->bits);
+    avz_bitwriter_t b = {dst, 0, 0};
+    for(int y = 0; y < rows; y++) {
+        uint16_t *cur = s->row[y & 1], *top = y ? s->row[~y & 1] : NULL;
+        avz_load_row(cur, plane_row(src, first + y), w, g->sample_size);
+        if(top)
+            avz_residuals(cur, top, w, *predictor, g->bits, s->res);
+        else {
+            s->res[0] = avz_zigzag(cur[0], g->bits);
+            for(int x = 1; x < w; x++)
+                s->res[x] = avz_zigzag(cur[x] - cur[x-1], g->bits);
+        }
+        avz_code_row(&b, ctx, cur, top, s->res, w, g->bits);
+        if((size_t)(b.p - dst) >= raw)
+            break;
+    }
+    if(b.n)
+        avz_put(&b, 0, 8 - b.n);
+    if((size_t)(b.p - dst) < raw)
+        return b.p - dst;
+    *predictor = AVZ_STORED;
+    for(int y = 0; y < rows; y++)
+        memcpy(dst + (size_t)y * g->row_size[plane], plane_row(src, first + y), g->row_size[plane]);
+    return raw;
+}
+
+static int avz_decode_slice(avz_scratch_t *s, const avz_geometry_t *g, const avz_slice_t *sl, const uint8_t *src, BYTE *dst)
+{
+    int plane = sl->plane, w = g->width[plane], bits = g->bits;
+    size_t raw = (size_t)g->row_size[plane] * sl->rows;
+    if(sl->predictor == AVZ_STORED) {
+        if(sl->size != raw)
+            return -1;
+        memcpy(dst, src, raw);
+        return 0;
+    }
+    if(sl->predictor > AVZ_MEDIAN)
+        return -1;
+    avz_context_t ctx[AVZ_CONTEXTS];
+    for(int i = 0; i < AVZ_CONTEXTS; i++)
+        ctx[i] = (avz_context_t){16, 1};
+    avz_bitreader_t b = {src, src + sl->size, 0, 0};
+    int mask = (1 << bits) - 1;
+    for(int y = 0; y < (int)sl->rows; y++) {
+        uint16_t *cur = s->row[y & 1], *top = y ? s->row[~y & 1] : NULL;
+        for(int x = 0; x < w; x++) {
+            int a = x ? cur[x-1] : top ? top[0] : 0;
+            int pred = a;
+            avz_context_t *c = &ctx[0];
+            if(top && x) {
+                c = &ctx[avz_context(a, top[x], top[x-1])];
+                if(sl->predictor == AVZ_GRADIENT)
+                    pred = a + top[x] - top[x-1];
+                else if(sl->predictor == AVZ_MEDIAN)
+                    pred = avz_median(a, top[x], top[x-1]);
+            }
+            int k = avz_k(c);
+            avz_fill(&b);
+            uint64_t head = b.acc << (64 - b.n);
+            int q = head ? __builtin_clzll(head) : 64;
+            uint32_t u;
+            if(q < AVZ_LIMIT) {
+                b.n -= q + 1;
+                u = ((uint32_t)q << k) | avz_get(&b, k);
+            } else {
+                b.n -= AVZ_LIMIT;
+                u = avz_get(&b, bits);
+            }
+            avz_adapt(c, u);
+            cur[x] = (pred + avz_unzigzag(u)) & mask;
+        }
+        avz_store_row(dst + (size_t)y * g->row_size[plane], cur, w, g->sample_size);
+    }
+    return b.p - (b.n >> 3) > b.end ? -1 : 0;
+}
+
+/* compresses a frame into dst, returns its size including the frame header */
+static size_t avz_encode_frame(avz_scratch_t *s, const avz_geometry_t *g, const frame_layout_t *layout, frame_t f, uint8_t *dst)
+{
+    avz_frame_t *fh = (avz_frame_t*)dst;
+    avz_slice_t *sl = (avz_slice_t*)(fh + 1);
+    uint8_t *data = (uint8_t*)(sl + AVZ_MAX_SLICES);
+    int n = 0;
+    for(int p = 0; p < g->planes; p++) {
+        plane_rows_t src;
+        frame_rows(layout->avs_h, f, layout->plane_id[p], &src);
+        int bands = g->height[p] >= AVZ_BANDS * 16 ? AVZ_BANDS : 1;
+        int band = (g->height[p] + bands - 1) / bands;
+        for(int y = 0; y < g->height[p]; y += band, n++) {
+            int predictor;
+            sl[n].plane = p;
+            sl[n].first_row = y;
+            sl[n].rows = y + band < g->height[p] ? band : g->height[p] - y;
+            sl[n].size = avz_encode_slice(s, g, p, &src, y, sl[n].rows, data, &predictor);
+            sl[n].predictor = predictor;
+            sl[n].reserved = 0;
+            data += sl[n].size;
+        }
+    }
+    // close the gap left by the unused slice headers
+    size_t table = n * sizeof(avz_slice_t);
+    size_t payload = data - (uint8_t*)(sl + AVZ_MAX_SLICES);
+    memmove((uint8_t*)sl + table, sl + AVZ_MAX_SLICES, payload);
+    fh->magic = AVZ_FRAME_MAGIC;
+    fh->size = table + payload;
+    fh->slices = n;
+    fh->reserved = 0;
+    return sizeof(avz_frame_t) + fh->size;
+}
+
+/* decompresses a frame (without its avz_frame_t) into packed planes */
+static int avz_decode_frame(avz_scratch_t *s, const avz_geometry_t *g, const avz_frame_t *fh, const uint8_t *src, BYTE *dst)
+{
+    const avz_slice_t *sl = (const avz_slice_t*)src;
+    size_t pos = fh->slices * sizeof(avz_slice_t);
+    if(fh->slices > AVZ_MAX_SLICES || pos > fh->size)
+        return -1;
+    for(uint32_t i = 0; i < fh->slices; i++) {
+        if(sl[i].plane >= g->planes || sl[i].first_row + sl[i].rows > (uint32_t)g->height[sl[i].plane] || sl[i].size > fh->size - pos)
+            return -1;
+        BYTE *plane = dst;
+        for(int p = 0; p < sl[i].plane; p++)
+            plane += (size_t)g->row_size[p] * g->height[p];
+        if(avz_decode_slice(s, g, &sl[i], src + pos, plane + (size_t)sl[i].first_row * g->row_size[sl[i].plane]))
+            return -1;
+        pos += sl[i].size;
+    }
+    return 0;
+}
+
+static int avz_write_all(int fd, const void *buf, size_t size)
+{
+    while(size) {
+        ssize_t ret = write(fd, buf, size);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return -1;
+        buf = (const char*)buf + ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+static int avz_read_at(int fd, void *buf, size_t size, int64_t offset)
+{
+    if(fd_seek(fd, offset, SEEK_SET) != offset)
+        return -1;
+    while(size) {
+        ssize_t ret = read(fd, buf, size);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return -1;
+        buf = (char*)buf + ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+/* writer side */
+typedef struct {
+    frame_t frame;
+    uint8_t *data;
+    size_t size;
+    int done;
+} avz_job_t;
+
+typedef struct {
+    int fd;
+    const frame_layout_t *layout;
+    avz_header_t hdr;
+    avz_geometry_t geo;
+    avz_job_t *jobs;
+    int depth;                  // frames in flight
+    int64_t submitted;
+    int64_t taken;
+    int64_t written;
+    pthread_t *threads;
+    int workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int quit;
+    uint64_t *index;
+    int index_size;
+    int64_t offset;
+} avz_t;
+
+static void *avz_worker(void *arg)
+{
+    avz_t *z = arg;
+    avz_scratch_t s;
+    pin_thread(0);
+    int ok = !avz_scratch_init(&s, &z->geo);
+    pthread_mutex_lock(&z->mutex);
+    for(;;) {
+        while(!z->quit && z->taken == z->submitted)
+            pthread_cond_wait(&z->cond, &z->mutex);
+        if(z->taken == z->submitted)
+            break;
+        avz_job_t *j = &z->jobs[z->taken++ % z->depth];
+        pthread_mutex_unlock(&z->mutex);
+        j->size = ok ? avz_encode_frame(&s, &z->geo, z->layout, j->frame, j->data) : 0;
+        pthread_mutex_lock(&z->mutex);
+        j->done = 1;
+        pthread_cond_broadcast(&z->cond);
+    }
+    pthread_mutex_unlock(&z->mutex);
+    avz_scratch_free(&s);
+    return NULL;
+}
+
+/* writes the oldest frame once it is compressed */
+static int avz_write_oldest(avz_t *z)
+{
+    avz_job_t *j = &z->jobs[z->written % z->depth];
+    pthread_mutex_lock(&z->mutex);
+    while(!j->done)
+        pthread_cond_wait(&z->cond, &z->mutex);
+    pthread_mutex_unlock(&z->mutex);
+    frame_release(z->layout->avs_h, j->frame);
+    j->frame = (frame_t){NULL};
+    j->done = 0;
+    z->written++;
+    if(!j->size || avz_write_all(z->fd, j->data, j->size))
+        return -1;
+    if(z->hdr.frames == (uint32_t)z->index_size) {
+        uint64_t *index = realloc(z->index, (z->index_size = z->index_size ? z->index_size * 2 : 1024) * sizeof(uint64_t));
+        if(!index)
+            return -1;
+        z->index = index;
+    }
+    z->index[z->hdr.frames++] = z->offset;
+    z->offset += j->size;
+    return 0;
+}
+
+static void avz_stop(avz_t *z)
+{
+    if(!z->threads)
+        return;
+    pthread_mutex_lock(&z->mutex);
+    z->quit = 1;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->mutex);
+    for(int i = 0; i < z->workers; i++)
+        pthread_join(z->threads[i], NULL);
+    free(z->threads);
+    z->threads = NULL;
+    for(; z->written < z->submitted; z->written++)
+        frame_release(z->layout->avs_h, z->jobs[z->written % z->depth].frame);
+}
+
+static void avz_free(avz_t *z)
+{
+    avz_stop(z);
+    for(int i = 0; z->jobs && i < z->depth; i++)
+        free(z->jobs[i].data);
+    free(z->jobs);
+    free(z->index);
+    z->jobs = NULL;
+    z->index = NULL;
+    pthread_mutex_destroy(&z->mutex);
+    pthread_cond_destroy(&z->cond);
+}
+
+/* writes the file header and starts the workers; fd is an empty file */
+static int avz_open(avz_t *z, int fd, const frame_layout_t *layout, const char *y4m, int y4m_len, int workers)
+{
+    memset(z, 0, sizeof(*z));
+    z->fd = fd;
+    z->layout = layout;
+    pthread_mutex_init(&z->mutex, NULL);
+    pthread_cond_init(&z->cond, NULL);
+    memcpy(z->hdr.magic, AVZ_MAGIC, sizeof(z->hdr.magic));
+    z->hdr.version = AVZ_VERSION;
+    z->hdr.header_size = sizeof(avz_header_t);
+    z->hdr.planes = layout->planes;
+    z->hdr.sample_size = layout->sample_size == 1 ? 1 : 2;
+    for(int p = 0; p < layout->planes; p++) {
+        z->hdr.row_size[p] = layout->row_size[p];
+        z->hdr.height[p] = layout->height[p];
+    }
+    snprintf(z->hdr.y4m, sizeof(z->hdr.y4m), "%.*s", y4m_len, y4m);
+    avz_geometry(&z->geo, &z->hdr);
+    z->offset = sizeof(avz_header_t);
+    z->workers = workers > 0 ? workers : 1;
+    z->depth = z->workers * 2;
+    z->jobs = calloc(z->depth, sizeof(avz_job_t));
+    z->threads = calloc(z->workers, sizeof(pthread_t));
+    if(!z->jobs || !z->threads)
+        return -1;
+    for(int i = 0; i < z->depth; i++)
+        if(!(z->jobs[i].data = malloc(z->geo.max_frame)))
+            return -1;
+    if(avz_write_all(fd, &z->hdr, sizeof(z->hdr)))
+        return -1;
+    for(int i = 0; i < z->workers; i++)
+        if(pthread_create(&z->threads[i], NULL, avz_worker, z)) {
+            z->workers = i;
+            return -1;
+        }
+    return 0;
+}
+
+/* queues a reference of the frame for compression and writes out whatever is finished */
+static int avz_write(avz_t *z, frame_t f)
+{
+    if(z->submitted - z->written == z->depth && avz_write_oldest(z))
+        return -1;
+    avz_job_t *j = &z->jobs[z->submitted % z->depth];
+    j->frame = frame_ref(z->layout->avs_h, f);
+    pthread_mutex_lock(&z->mutex);
+    z->submitted++;
+    pthread_cond_broadcast(&z->cond);
+    int ready = z->jobs[z->written % z->depth].done;
+    pthread_mutex_unlock(&z->mutex);
+    return ready ? avz_write_oldest(z) : 0;
+}
+
+/* writes the remaining frames and the index, and fills in the header */
+static int avz_finish(avz_t *z)
+{
+    int err = 0;
+    while(!err && z->written < z->submitted)
+        err = avz_write_oldest(z);
+    avz_stop(z);
+    if(!err) {
+        uint32_t head[2] = {AVZ_INDEX_MAGIC, z->hdr.frames};
+        z->hdr.index_offset = z->offset;
+        err = avz_write_all(z->fd, head, sizeof(head)) || avz_write_all(z->fd, z->index, z->hdr.frames * sizeof(uint64_t)) ||
+              fd_seek(z->fd, 0, SEEK_SET) != 0 || avz_write_all(z->fd, &z->hdr, sizeof(z->hdr));
+        z->offset += sizeof(head) + z->hdr.frames * sizeof(uint64_t);
+    }
+    avz_free(z);
+    return err ? -1 : 0;
+}
+
+/* reader side */
+typedef struct {
+    int fd;
+    avz_header_t hdr;
+    avz_geometry_t geo;
+    avz_scratch_t scratch;
+    uint64_t *index;
+    int frames;
+    uint8_t *buf;
+} avz_reader_t;
+
+static void avz_reader_close(avz_reader_t *r)
+{
+    if(r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+    avz_scratch_free(&r->scratch);
+    free(r->index);
+    free(r->buf);
+}
+
+static int avz_reader_open(avz_reader_t *r, const char *path)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY | O_BINARY);
+    if(r->fd < 0 || avz_read_at(r->fd, &r->hdr, sizeof(r->hdr), 0) || memcmp(r->hdr.magic, AVZ_MAGIC, sizeof(r->hdr.magic)) ||
+       r->hdr.version != AVZ_VERSION || r->hdr.header_size != sizeof(avz_header_t) || r->hdr.planes < 1 || r->hdr.planes > 4 ||
+       (r->hdr.sample_size != 1 && r->hdr.sample_size != 2))
+        goto fail;
+    r->hdr.y4m[sizeof(r->hdr.y4m) - 1] = 0;
+    for(uint32_t p = 0; p < r->hdr.planes; p++)
+        if(!r->hdr.row_size[p] || r->hdr.row_size[p] % r->hdr.sample_size || r->hdr.row_size[p] > (1 << 20) || r->hdr.height[p] > (1 << 20))
+            goto fail;
+    avz_geometry(&r->geo, &r->hdr);
+    if(avz_scratch_init(&r->scratch, &r->geo) || !(r->buf = malloc(r->geo.max_frame)))
+        goto fail;
+    uint32_t head[2];
+    if(r->hdr.index_offset && !avz_read_at(r->fd, head, sizeof(head), r->hdr.index_offset) &&
+       head[0] == AVZ_INDEX_MAGIC && head[1] == r->hdr.frames && (r->index = malloc(((size_t)head[1] + 1) * sizeof(uint64_t))) &&
+       !avz_read_at(r->fd, r->index, head[1] * sizeof(uint64_t), r->hdr.index_offset + sizeof(head))) {
+        r->frames = head[1];
+        return 0;
+    }
+    // unfinished file: walk the frames
+    int size = 0;
+    int64_t offset = sizeof(avz_header_t);
+    avz_frame_t fh;
+    while(!avz_read_at(r->fd, &fh, sizeof(fh), offset) && fh.magic == AVZ_FRAME_MAGIC && fh.size <= r->geo.max_frame &&
+          fd_seek(r->fd, 0, SEEK_END) >= offset + (int64_t)sizeof(fh) + fh.size) {
+        if(r->frames == size) {
+            uint64_t *index = realloc(r->index, (size = size ? size * 2 : 1024) * sizeof(uint64_t));
+            if(!index)
+                goto fail;
+            r->index = index;
+        }
+        r->index[r->frames++] = offset;
+        offset += sizeof(fh) + fh.size;
+    }
+    return 0;
+fail:
+    avz_reader_close(r);
+    return -1;
+}
+
+static int avz_read_frame(avz_reader_t *r, int n, BYTE *dst)
+{
+    avz_frame_t fh;
+    if(n < 0 || n >= r->frames || avz_read_at(r->fd, &fh, sizeof(fh), r->index[n]) || fh.magic != AVZ_FRAME_MAGIC ||
+       fh.size > r->geo.max_frame || avz_read_at(r->fd, r->buf, fh.size, r->index[n] + sizeof(fh)))
+        return -1;
+    return avz_decode_frame(&r->scratch, &r->geo, &fh, r->buf, dst);
+}
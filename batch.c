@@ -0,0 +1,308 @@
+/*****************************************************************************
+ * batch.c: renders the jobs of a list on a pool of threads (-batch)
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *****************************************************************************/
+
+/* A job list has one job per line: the script, the output file and optionally the frames,
+ * as "A-B" (inclusive), "A-" or a single frame "A". Jobs without frames use -seek and
+ * -frames. Paths with spaces go in double quotes, and '#' starts a comment. A job writes
+ * one output; it is created once the script has loaded, and removed if the job fails.
+ *
+ * The jobs run in this process on the machinery of -server. Up to -jobs of them run at a
+ * time, each on a script environment of a server_t that keeps one environment per worker.
+ * The library is loaded once, and a plugin that a script loads stays loaded for the next
+ * jobs on that environment. -memmax is split between the workers, so the caches of all
+ * running jobs stay within it together. */
+
+#if defined(AVS_POSIX)
+#define BATCH_MAX_LINE 8192
+
+typedef struct {
+    char *script;           // absolute paths: Import changes the working directory while it runs
+    char *output;
+    int seek;               // -1 = -seek and -frames of the command line
+    int frames;
+    int line;
+    int status;             // -1 until the job ran
+    int rendered;           // frames written
+    int64_t bytes;
+    int64_t elapsed;        // us
+    char message[512];
+} batch_job_t;
+
+typedef struct {
+    server_t srv;
+    const server_request_t *tmpl;
+    batch_job_t *jobs;
+    int count;
+    int next;               // the next job to hand out, under srv.mutex
+} batch_t;
+
+/* the next word of a job line, NULL at its end or at a comment; cuts the line up in place */
+static char *batch_token(char **p)
+{
+    char *s = *p + strspn(*p, " \t");
+    if(!*s || *s == '#')
+        return NULL;
+    char *end;
+    if(*s == '"') {
+        end = strchr(++s, '"');
+        if(!end)
+            end = s + strlen(s);
+    } else
+        end = s + strcspn(s, " \t");
+    *p = *end ? end + 1 : end;
+    *end = 0;
+    return s;
+}
+
+/* "A-B", "A-" or "A" */
+static int batch_range(batch_job_t *j, const char *s)
+{
+    char *end;
+    long first = strtol(s, &end, 10);
+    if(end == s || first < 0 || first > INT_MAX || (*end && *end != '-'))
+        return -1;
+    j->seek = first;
+    j->frames = *end ? 0 : 1;
+    if(*end && end[1]) {
+        const char *last_s = end + 1;
+        long last = strtol(last_s, &end, 10);
+        if(end == last_s || *end || last < first || last > INT_MAX)
+            return -1;
+        j->frames = last - first + 1;
+    }
+    return 0;
+}
+
+/* the path made absolute against the working directory */
+static char *batch_path(const char *path, int resolve)
+{
+    char buf[PATH_MAX];
+    if(resolve && realpath(path, buf))
+        return strdup(buf);
+    if(*path == '/' || !getcwd(buf, sizeof(buf)))
+        return strdup(path);
+    size_t len = strlen(buf) + strlen(path) + 2;
+    char *abs = malloc(len);
+    if(abs)
+        snprintf(abs, len, "%s/%s", buf, path);
+    return abs;
+}
+
+static int batch_load(batch_t *b, const char *path)
+{
+    FILE *fh = !strcmp(path, "-") ? stdin : fopen(path, "r");
+    if(!fh) {
+        fprintf(stderr, "Error: failed to open job list \"%s\".\n", path);
+        return -1;
+    }
+    char line[BATCH_MAX_LINE];
+    int alloc = 0;
+    int err = 0;
+    for(int l = 1; !err && fgets(line, sizeof(line), fh); l++) {
+        line[strcspn(line, "\r\n")] = 0;
+        char *p = line;
+        char *script = batch_token(&p);
+        if(!script)
+            continue;
+        char *output = batch_token(&p);
+        char *range = output ? batch_token(&p) : NULL;
+        batch_job_t j = {0};
+        j.seek = -1;
+        j.line = l;
+        j.status = -1;
+        if(!output || (range && batch_range(&j, range)) || batch_token(&p)) {
+            fprintf(stderr, "Error: job list \"%s\", line %d: expected a script, an output and optionally the frames.\n", path, l);
+            err = 1;
+        } else if(!*output || !strcmp(output, "-") || !strncmp(output, "shm:", 4) || !strncmp(output, "avz:", 4)) {
+            fprintf(stderr, "Error: job list \"%s\", line %d: jobs can only write to files.\n", path, l);
+            err = 1;
+        } else if(!(j.script = batch_path(script, 1)) || !(j.output = batch_path(output, 0))) {
+            free(j.script);
+            err = 1;
+        } else {
+            if(b->count == alloc) {
+                batch_job_t *jobs = realloc(b->jobs, (alloc = alloc ? alloc * 2 : 64) * sizeof(*jobs));
+                if(!jobs) {
+                    free(j.script);
+                    free(j.output);
+                    err = 1;
+                    break;
+                }
+                b->jobs = jobs;
+            }
+            b->jobs[b->count++] = j;
+        }
+    }
+    if(fh != stdin)
+        fclose(fh);
+    if(!err && !b->count) {
+        fprintf(stderr, "Error: job list \"%s\" holds no jobs.\n", path);
+        err = 1;
+    }
+    return err ? -1 : 0;
+}
+
+static void batch_job(batch_t *b, int n)
+{
+    batch_job_t *j = &b->jobs[n];
+    server_request_t req = *b->tmpl;
+    server_reply_t reply = {SERVER_MAGIC};
+    struct stat st;
+    int64_t start = avs2yuv_mdate();
+    snprintf(req.script, sizeof(req.script), "%s", j->script);
+    if(j->seek >= 0) {
+        req.seek = j->seek;
+        req.frames = j->frames;
+    }
+    reply.status = 1;
+    // the output is only created once the script has loaded, see server_render()
+    if(stat(req.script, &st))
+        snprintf(reply.message, sizeof(reply.message), "can't access \"%.400s\"", j->script);
+    else
+        server_handle(&b->srv, &req, &st, -1, j->output, &reply);
+    j->elapsed = avs2yuv_mdate() - start;
+    j->status = reply.status;
+    j->rendered = reply.frames;
+    j->bytes = !reply.status && !stat(j->output, &st) ? st.st_size : 0;
+    memcpy(j->message, reply.message, sizeof(j->message));
+    if(reply.status)
+        fprintf(stderr, "Job %d: %s: %s.\n", n + 1, j->script, reply.message);
+    else if(!b->srv.nostderr)
+        fprintf(stderr, "Job %d: %s, %d frames in %.3f s (%.2f fps)\n", n + 1, j->output, reply.frames,
+                j->elapsed / 1000000., j->elapsed > 0 ? reply.frames * 1000000. / j->elapsed : 0);
+}
+
+static void *batch_worker(void *arg)
+{
+    batch_t *b = arg;
+    pin_thread(1);
+    for(;;) {
+        pthread_mutex_lock(&b->srv.mutex);
+        int n = b_ctrl_c ? b->count : b->next++;
+        pthread_mutex_unlock(&b->srv.mutex);
+        if(n >= b->count)
+            break;
+        batch_job(b, n);
+    }
+    return NULL;
+}
+
+/* -report: totals plus status and throughput of every job as JSON */
+static int batch_report(const batch_t *b, const char *path, const char *list, const char *status, int64_t elapsed)
+{
+    FILE *fh = fopen(path, "w");
+    if(!fh) {
+        fprintf(stderr, "Error: failed to create report \"%s\".\n", path);
+        return -1;
+    }
+    static const char *job_status[] = {"not run", "ok", "error"};
+    fprintf(fh, "{\n  \"version\": 1,\n  \"batch\": ");
+    json_string(fh, list);
+    fprintf(fh, ",\n  \"status\": \"%s\",\n  \"elapsed_us\": %"PRId64",\n  \"peak_rss_kib\": %"PRId64",\n  \"jobs\": [",
+            status, elapsed, peak_rss_kib());
+    for(int i = 0; i < b->count; i++) {
+        const batch_job_t *j = &b->jobs[i];
+        fprintf(fh, "%s\n    {\"script\": ", i ? "," : "");
+        json_string(fh, j->script);
+        fprintf(fh, ", \"output\": ");
+        json_string(fh, j->output);
+        fprintf(fh, ", \"status\": \"%s\", \"frames\": %d, \"bytes\": %"PRId64", \"elapsed_us\": %"PRId64", \"fps\": %.3f",
+                job_status[j->status + 1], j->rendered, j->bytes, j->elapsed,
+                j->elapsed > 0 ? j->rendered * 1000000. / j->elapsed : 0);
+        if(j->status > 0) {
+            fprintf(fh, ", \"message\": ");
+            json_string(fh, j->message);
+        }
+        fprintf(fh, "}");
+    }
+    fprintf(fh, "\n  ]\n}\n");
+    if(fclose(fh)) {
+        fprintf(stderr, "Error: failed to write report \"%s\".\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* runs every job of the list with up to 'workers' at a time; fails if any of them did */
+static int batch_run(const char *list, avs_hnd_t *library, const server_request_t *tmpl, int workers, int reimport,
+                     int threads, const memory_t *memory, const char *report, int nostderr)
+{
+    batch_t b = {{0}};
+    if(batch_load(&b, list)) {
+        for(int i = 0; i < b.count; i++) {
+            free(b.jobs[i].script);
+            free(b.jobs[i].output);
+        }
+        free(b.jobs);
+        return -1;
+    }
+    if(workers > b.count)
+        workers = b.count;
+    b.srv.library = library;
+    b.srv.keep = workers;
+    b.srv.reimport = reimport;
+    b.srv.threads = threads;
+    b.srv.memory = memory;
+    b.srv.nostderr = nostderr;
+    b.tmpl = tmpl;
+    pthread_mutex_init(&b.srv.mutex, NULL);
+    pthread_cond_init(&b.srv.cond, NULL);
+    signal(SIGINT, sigintHandler);
+    signal(SIGTERM, sigintHandler);
+    if(!nostderr)
+        fprintf(stderr, "%s\nBatch:\t\t%d jobs from \"%s\", %d at a time\n", MY_VERSION, b.count, list, workers);
+    pthread_t thread[SERVER_MAX_ENVS];
+    int started = 0;
+    int64_t start = avs2yuv_mdate();
+    while(started < workers && !pthread_create(&thread[started], NULL, batch_worker, &b))
+        started++;
+    if(!started)
+        batch_worker(&b);
+    for(int i = 0; i < started; i++)
+        pthread_join(thread[i], NULL);
+    int64_t elapsed = avs2yuv_mdate() - start;
+    for(int i = 0; i < SERVER_MAX_ENVS; i++)
+        if(b.srv.envs[i])
+            server_drop_env(b.srv.envs[i]);
+    pthread_mutex_destroy(&b.srv.mutex);
+    pthread_cond_destroy(&b.srv.cond);
+    int done = 0, failed = 0, frames = 0;
+    int64_t bytes = 0;
+    for(int i = 0; i < b.count; i++) {
+        done += !b.jobs[i].status;
+        failed += b.jobs[i].status > 0;
+        frames += b.jobs[i].rendered;
+        bytes += b.jobs[i].bytes;
+    }
+    if(!nostderr) {
+        fprintf(stderr, "\nJobs:\t\t%d done, %d failed, %d not run\n", done, failed, b.count - done - failed);
+        fprintf(stderr, "Frames:\t\t%d in %.3f s, %.2f fps, %.1f MiB/s\n", frames, elapsed / 1000000.,
+                elapsed > 0 ? frames * 1000000. / elapsed : 0, elapsed > 0 ? bytes * 1000000. / elapsed / (1024 * 1024) : 0);
+        for(int i = 0; i < b.count; i++)
+            if(b.jobs[i].status > 0)
+                fprintf(stderr, "Failed:\t\tjob %d (line %d), %s: %s\n", i + 1, b.jobs[i].line, b.jobs[i].script, b.jobs[i].message);
+    }
+    int retval = done == b.count ? 0 : -1;
+    if(report && batch_report(&b, report, list, failed ? "error" : retval ? "interrupted" : "ok", elapsed))
+        retval = -1;
+    for(int i = 0; i < b.count; i++) {
+        free(b.jobs[i].script);
+        free(b.jobs[i].output);
+    }
+    free(b.jobs);
+    return retval;
+}
+#else
+static int batch_run(const char *list, avs_hnd_t *library, const server_request_t *tmpl, int workers, int reimport,
+                     int threads, const memory_t *memory, const char *report, int nostderr)
+{
+    fprintf(stderr, "Error: -batch is not supported on this platform.\n");
+    return -1;
+}
+#endif
@@ -0,0 +1,453 @@
+/*****************************************************************************
+ * convert.c: bit depth conversion and packed layouts on the way out
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *****************************************************************************/
+
+/* Frames that are not written as they come out of the script (-bits, -dither, -stacked,
+ * -pack, 10-14 bit mono in y4m) are converted row by row into packed memory. Every sample
+ * takes the same path:
+ *
+ *   it is read as 16 bits       8-bit samples are widened, the stacked hack is merged from
+ *                               its MSB rows (top half) and LSB rows (bottom half)
+ *   << shl                      moves it to the top of the 16 bits
+ *   + bias, saturating          rounding, or a Bayer 8x8 ordered dither with -dither
+ *   >> shr                      brings it down to the output depth
+ *   << post                     MSB aligned layouts (P010)
+ *
+ * The saturating add keeps rounding at the top of the range from wrapping around, so the
+ * same kernel goes up and down in depth. Float clips are quantized to the output depth in
+ * the reading step instead (f * scale + offset + bias, clamped and truncated, with chroma
+ * centered on 0 as in AviSynth+), after which the integer steps change nothing. The kernels are plain C, SSE2 and AVX2, picked at
+ * runtime; rows are done in chunks of CONVERT_CHUNK samples so the scratch rows fit on the
+ * stack of any writer thread. */
+
+enum { PACK_PLANAR, PACK_P010, PACK_P016, PACK_V210 };
+
+#define CONVERT_CHUNK 1536      // samples per step, a multiple of the 16 bias columns and of v210's 6 pixel groups
+
+/* the output format asked for on the command line; all zero writes the clip as it is */
+typedef struct {
+    int bits;               // -bits, 0 = the depth of the clip
+    int dither;
+    int limited;            // -range limited: float clips go to 16-235/240 instead of the full range
+    int stacked;
+    int pack;
+    int alpha_plane;        // -rawalpha: the alpha plane follows the colour planes
+} output_format_t;
+
+typedef struct {
+    const char *name;
+    void (*widen)(uint16_t *dst, const BYTE *src, int n);
+    void (*merge)(uint16_t *dst, const BYTE *msb, const BYTE *lsb, int n);
+    void (*shift16)(uint16_t *dst, const uint16_t *src, int n, int shl, int shr, int post, const uint16_t *bias);
+    void (*shift8)(BYTE *dst, const uint16_t *src, int n, int shl, int shr, const uint16_t *bias);
+    void (*interleave)(uint16_t *dst, const uint16_t *u, const uint16_t *v, int n);
+    void (*quantize)(uint16_t *dst, const float *src, int n, float scale, float max, const float *add);
+} convert_kernels_t;
+
+typedef struct {
+    int planes;             // source planes
+    int plane_id[4];
+    int width[4];           // samples per row
+    int height[4];          // rows written, half the rows of a stacked source plane
+    int src_bytes;          // 2 for 16-bit samples, including the interleaved hack, 4 for float
+    int stacked;
+    int dst_bytes;
+    int src_bits;
+    int dst_bits;           // significant bits, 10 for P010 and v210
+    int shl, shr, post;
+    int pack;
+    int dither;
+    uint16_t bias[8][16];   // by row & 7 and column & 15
+    float scale[4];         // float clips: per plane
+    float offset[4];
+    float fbias[8][16];     // float clips: rounding or dither, by row & 7 and column & 15
+    const convert_kernels_t *k;
+} convert_t;
+
+static inline uint16_t convert_sample(unsigned v, int shl, int shr, int post, unsigned bias)
+{
+    v = ((v << shl) & 0xffff) + bias;
+    return (v > 0xffff ? 0xffff : v) >> shr << post;
+}
+
+static void convert_widen_c(uint16_t *dst, const BYTE *src, int n)
+{
+    for(int i = 0; i < n; i++)
+        dst[i] = src[i];
+}
+
+static void convert_merge_c(uint16_t *dst, const BYTE *msb, const BYTE *lsb, int n)
+{
+    for(int i = 0; i < n; i++)
+        dst[i] = msb[i] << 8 | lsb[i];
+}
+
+static void convert_shift16_c(uint16_t *dst, const uint16_t *src, int n, int shl, int shr, int post, const uint16_t *bias)
+{
+    for(int i = 0; i < n; i++)
+        dst[i] = convert_sample(src[i], shl, shr, post, bias[i & 15]);
+}
+
+static void convert_shift8_c(BYTE *dst, const uint16_t *src, int n, int shl, int shr, const uint16_t *bias)
+{
+    for(int i = 0; i < n; i++)
+        dst[i] = convert_sample(src[i], shl, shr, 0, bias[i & 15]);
+}
+
+static void convert_interleave_c(uint16_t *dst, const uint16_t *u, const uint16_t *v, int n)
+{
+    for(int i = 0; i < n; i++) {
+        dst[2*i] = u[i];
+        dst[2*i+1] = v[i];
+    }
+}
+
+/* add holds offset + bias for the 16 columns; NaN ends up as 0 */
+static void convert_quantize_c(uint16_t *dst, const float *src, int n, float scale, float max, const float *add)
+{
+    for(int i = 0; i < n; i++) {
+        float t = src[i] * scale + add[i & 15];
+        dst[i] = t > 0 ? t < max ? t : max : 0;
+    }
+}
+
+static const convert_kernels_t convert_kernels_c = {
+    "C", convert_widen_c, convert_merge_c, convert_shift16_c, convert_shift8_c, convert_interleave_c, convert_quantize_c
+};
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static void convert_widen_sse2(uint16_t *dst, const BYTE *src, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi8(x, zero));
+        _mm_storeu_si128((__m128i*)(dst + i + 8), _mm_unpackhi_epi8(x, zero));
+    }
+    for(; i < n; i++)
+        dst[i] = src[i];
+}
+
+static void convert_merge_sse2(uint16_t *dst, const BYTE *msb, const BYTE *lsb, int n)
+{
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i m = _mm_loadu_si128((const __m128i*)(msb + i));
+        __m128i l = _mm_loadu_si128((const __m128i*)(lsb + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi8(l, m));
+        _mm_storeu_si128((__m128i*)(dst + i + 8), _mm_unpackhi_epi8(l, m));
+    }
+    for(; i < n; i++)
+        dst[i] = msb[i] << 8 | lsb[i];
+}
+
+static void convert_shift16_sse2(uint16_t *dst, const uint16_t *src, int n, int shl, int shr, int post, const uint16_t *bias)
+{
+    const __m128i l = _mm_cvtsi32_si128(shl), r = _mm_cvtsi32_si128(shr), q = _mm_cvtsi32_si128(post);
+    const __m128i b = _mm_loadu_si128((const __m128i*)bias); // the bias repeats every 8 columns
+    int i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m128i x = _mm_sll_epi16(_mm_loadu_si128((const __m128i*)(src + i)), l);
+        x = _mm_srl_epi16(_mm_adds_epu16(x, b), r);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_sll_epi16(x, q));
+    }
+    for(; i < n; i++)
+        dst[i] = convert_sample(src[i], shl, shr, post, bias[i & 15]);
+}
+
+static void convert_shift8_sse2(BYTE *dst, const uint16_t *src, int n, int shl, int shr, const uint16_t *bias)
+{
+    const __m128i l = _mm_cvtsi32_si128(shl), r = _mm_cvtsi32_si128(shr);
+    const __m128i b = _mm_loadu_si128((const __m128i*)bias);
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i x0 = _mm_sll_epi16(_mm_loadu_si128((const __m128i*)(src + i)), l);
+        __m128i x1 = _mm_sll_epi16(_mm_loadu_si128((const __m128i*)(src + i + 8)), l);
+        x0 = _mm_srl_epi16(_mm_adds_epu16(x0, b), r);
+        x1 = _mm_srl_epi16(_mm_adds_epu16(x1, b), r);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(x0, x1));
+    }
+    for(; i < n; i++)
+        dst[i] = convert_sample(src[i], shl, shr, 0, bias[i & 15]);
+}
+
+static void convert_interleave_sse2(uint16_t *dst, const uint16_t *u, const uint16_t *v, int n)
+{
+    int i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(u + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(v + i));
+        _mm_storeu_si128((__m128i*)(dst + 2*i), _mm_unpacklo_epi16(a, b));
+        _mm_storeu_si128((__m128i*)(dst + 2*i + 8), _mm_unpackhi_epi16(a, b));
+    }
+    for(; i < n; i++) {
+        dst[2*i] = u[i];
+        dst[2*i+1] = v[i];
+    }
+}
+
+static void convert_quantize_sse2(uint16_t *dst, const float *src, int n, float scale, float max, const float *add)
+{
+    const __m128 s = _mm_set1_ps(scale), m = _mm_set1_ps(max), zero = _mm_setzero_ps();
+    const __m128i half = _mm_set1_epi32(32768), flip = _mm_set1_epi16(-32768);
+    const __m128 a0 = _mm_loadu_ps(add), a1 = _mm_loadu_ps(add + 4);
+    int i = 0;
+    for(; i + 8 <= n; i += 8) {
+        // maxps takes the second operand for NaN
+        __m128 t0 = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i), s), a0), zero), m);
+        __m128 t1 = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), s), a1), zero), m);
+        // no packus_epi32 before SSE4.1: pack signed around 32768 and flip the top bit back
+        __m128i x = _mm_packs_epi32(_mm_sub_epi32(_mm_cvttps_epi32(t0), half), _mm_sub_epi32(_mm_cvttps_epi32(t1), half));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(x, flip));
+    }
+    for(; i < n; i++) {
+        float t = src[i] * scale + add[i & 15];
+        dst[i] = t > 0 ? t < max ? t : max : 0;
+    }
+}
+
+static const convert_kernels_t convert_kernels_sse2 = {
+    "SSE2", convert_widen_sse2, convert_merge_sse2, convert_shift16_sse2, convert_shift8_sse2, convert_interleave_sse2,
+    convert_quantize_sse2
+};
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVERT_AVX2
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void convert_widen_avx2(uint16_t *dst, const BYTE *src, int n)
+{
+    int i = 0;
+    for(; i + 16 <= n; i += 16)
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i))));
+    for(; i < n; i++)
+        dst[i] = src[i];
+}
+
+__attribute__((target("avx2")))
+static void convert_merge_avx2(uint16_t *dst, const BYTE *msb, const BYTE *lsb, int n)
+{
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256i m = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(msb + i)));
+        __m256i l = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(lsb + i)));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(_mm256_slli_epi16(m, 8), l));
+    }
+    for(; i < n; i++)
+        dst[i] = msb[i] << 8 | lsb[i];
+}
+
+__attribute__((target("avx2")))
+static void convert_shift16_avx2(uint16_t *dst, const uint16_t *src, int n, int shl, int shr, int post, const uint16_t *bias)
+{
+    const __m128i l = _mm_cvtsi32_si128(shl), r = _mm_cvtsi32_si128(shr), q = _mm_cvtsi32_si128(post);
+    const __m256i b = _mm256_loadu_si256((const __m256i*)bias);
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_sll_epi16(_mm256_loadu_si256((const __m256i*)(src + i)), l);
+        x = _mm256_srl_epi16(_mm256_adds_epu16(x, b), r);
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_sll_epi16(x, q));
+    }
+    for(; i < n; i++)
+        dst[i] = convert_sample(src[i], shl, shr, post, bias[i & 15]);
+}
+
+__attribute__((target("avx2")))
+static void convert_shift8_avx2(BYTE *dst, const uint16_t *src, int n, int shl, int shr, const uint16_t *bias)
+{
+    const __m128i l = _mm_cvtsi32_si128(shl), r = _mm_cvtsi32_si128(shr);
+    const __m256i b = _mm256_loadu_si256((const __m256i*)bias);
+    int i = 0;
+    for(; i + 32 <= n; i += 32) {
+        __m256i x0 = _mm256_sll_epi16(_mm256_loadu_si256((const __m256i*)(src + i)), l);
+        __m256i x1 = _mm256_sll_epi16(_mm256_loadu_si256((const __m256i*)(src + i + 16)), l);
+        x0 = _mm256_srl_epi16(_mm256_adds_epu16(x0, b), r);
+        x1 = _mm256_srl_epi16(_mm256_adds_epu16(x1, b), r);
+        // packus works within 128-bit lanes, put the quarters back in order
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(x0, x1), 0xd8));
+    }
+    for(; i < n; i++)
+        dst[i] = convert_sample(src[i], shl, shr, 0, bias[i & 15]);
+}
+
+__attribute__((target("avx2")))
+static void convert_interleave_avx2(uint16_t *dst, const uint16_t *u, const uint16_t *v, int n)
+{
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(u + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(v + i));
+        __m256i lo = _mm256_unpacklo_epi16(a, b);
+        __m256i hi = _mm256_unpackhi_epi16(a, b);
+        _mm256_storeu_si256((__m256i*)(dst + 2*i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(dst + 2*i + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    for(; i < n; i++) {
+        dst[2*i] = u[i];
+        dst[2*i+1] = v[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void convert_quantize_avx2(uint16_t *dst, const float *src, int n, float scale, float max, const float *add)
+{
+    const __m256 s = _mm256_set1_ps(scale), m = _mm256_set1_ps(max), zero = _mm256_setzero_ps();
+    const __m256 a = _mm256_loadu_ps(add);
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256 t0 = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), s), a), zero), m);
+        __m256 t1 = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i + 8), s), a), zero), m);
+        __m256i x = _mm256_packus_epi32(_mm256_cvttps_epi32(t0), _mm256_cvttps_epi32(t1));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_permute4x64_epi64(x, 0xd8));
+    }
+    for(; i < n; i++) {
+        float t = src[i] * scale + add[i & 15];
+        dst[i] = t > 0 ? t < max ? t : max : 0;
+    }
+}
+
+static const convert_kernels_t convert_kernels_avx2 = {
+    "AVX2", convert_widen_avx2, convert_merge_avx2, convert_shift16_avx2, convert_shift8_avx2, convert_interleave_avx2,
+    convert_quantize_avx2
+};
+#endif
+
+/* AVS2YUV_SIMD=c or sse2 caps the kernels, for comparing them */
+static const convert_kernels_t *convert_pick_kernels(void)
+{
+    const char *cap = getenv("AVS2YUV_SIMD");
+    if(cap && !strcmp(cap, "c"))
+        return &convert_kernels_c;
+#if defined(CONVERT_AVX2)
+    if(!(cap && !strcmp(cap, "sse2")) && __builtin_cpu_supports("avx2"))
+        return &convert_kernels_avx2;
+#endif
+#if defined(__SSE2__)
+    return &convert_kernels_sse2;
+#else
+    return &convert_kernels_c;
+#endif
+}
+
+/* fills in the shifts, the bias table and the kernels once the geometry and depths are set */
+static void convert_init(convert_t *c)
+{
+    static const uint8_t bayer[8][8] = {
+        { 0, 32,  8, 40,  2, 34, 10, 42}, {48, 16, 56, 24, 50, 18, 58, 26},
+        {12, 44,  4, 36, 14, 46,  6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+        { 3, 35, 11, 43,  1, 33,  9, 41}, {51, 19, 59, 27, 49, 17, 57, 25},
+        {15, 47,  7, 39, 13, 45,  5, 37}, {63, 31, 55, 23, 61, 29, 53, 21},
+    };
+    c->shl = 16 - c->src_bits;
+    c->shr = 16 - c->dst_bits;
+    c->post = c->pack == PACK_P010 ? 6 : 0;
+    for(int y = 0; y < 8; y++)
+        for(int x = 0; x < 16; x++) {
+            c->bias[y][x] = !c->shr ? 0 : c->dither ? bayer[y][x & 7] << c->shr >> 6 : 1 << (c->shr - 1);
+            c->fbias[y][x] = c->dither ? (bayer[y][x & 7] + .5f) / 64 : .5f;
+        }
+    c->k = convert_pick_kernels();
+}
+
+/* n samples of row y of plane p starting at column x, as 16 bits */
+static const uint16_t *convert_read(const convert_t *c, const plane_rows_t *src, int p, int y, int x, int n, uint16_t *tmp)
+{
+    const BYTE *row = plane_row(&src[p], y);
+    if(c->src_bytes == 4) {
+        float add[16];
+        for(int i = 0; i < 16; i++)
+            add[i] = c->offset[p] + c->fbias[y & 7][i];
+        c->k->quantize(tmp, (const float*)row + x, n, c->scale[p], (1 << c->src_bits) - 1, add);
+        return tmp;
+    }
+    if(c->src_bytes == 2)
+        return (const uint16_t*)row + x;
+    if(c->stacked)
+        c->k->merge(tmp, row + x, plane_row(&src[p], y + c->height[p]) + x, n);
+    else
+        c->k->widen(tmp, row + x, n);
+    return tmp;
+}
+
+/* 6 pixels in four little endian words: Cb Y Cr | Y Cb Y | Cr Y Cb | Y Cr Y, 10 bits each */
+static void convert_v210(BYTE *dst, const uint16_t *y, const uint16_t *u, const uint16_t *v, int n)
+{
+    for(int i = 0; i < n; i += 6, dst += 16) {
+        uint16_t s[12] = {0};
+        for(int j = 0; j < 6 && i + j < n; j++) {
+            s[2*j+1] = y[i+j];
+            s[2*j] = j & 1 ? v[(i+j)/2] : u[(i+j)/2];
+        }
+        for(int w = 0; w < 4; w++) {
+            uint32_t word = s[3*w] | (uint32_t)s[3*w+1] << 10 | (uint32_t)s[3*w+2] << 20;
+            dst[4*w] = word;
+            dst[4*w+1] = word >> 8;
+            dst[4*w+2] = word >> 16;
+            dst[4*w+3] = word >> 24;
+        }
+    }
+}
+
+/* bytes per v210 row: groups of 48 pixels in 128 bytes */
+static int convert_v210_row_size(int width)
+{
+    return (width + 47) / 48 * 128;
+}
+
+/* writes the converted frame into dst, frame_size bytes */
+static void convert_frame(const convert_t *c, avs_hnd_t *avs_h, frame_t f, BYTE *dst)
+{
+    uint16_t tmp[3][CONVERT_CHUNK];
+    uint16_t out[2][CONVERT_CHUNK];
+    plane_rows_t src[4];
+    for(int p = 0; p < c->planes; p++)
+        frame_rows(avs_h, f, c->plane_id[p], &src[p]);
+    if(c->pack == PACK_V210) {
+        int row_size = convert_v210_row_size(c->width[0]);
+        for(int y = 0; y < c->height[0]; y++, dst += row_size) {
+            const uint16_t *bias = c->bias[y & 7];
+            memset(dst, 0, row_size);
+            for(int x = 0; x < c->width[0]; x += CONVERT_CHUNK) {
+                int n = c->width[0] - x < CONVERT_CHUNK ? c->width[0] - x : CONVERT_CHUNK;
+                int cn = (n + 1) / 2;
+                c->k->shift16(tmp[0], convert_read(c, src, 0, y, x, n, tmp[0]), n, c->shl, c->shr, 0, bias);
+                c->k->shift16(tmp[1], convert_read(c, src, 1, y, x / 2, cn, tmp[1]), cn, c->shl, c->shr, 0, bias);
+                c->k->shift16(tmp[2], convert_read(c, src, 2, y, x / 2, cn, tmp[2]), cn, c->shl, c->shr, 0, bias);
+                convert_v210(dst + x / 6 * 16, tmp[0], tmp[1], tmp[2], n);
+            }
+        }
+        return;
+    }
+    for(int p = 0; p < c->planes; p++) {
+        int interleave = c->pack && p == 1;
+        if(c->pack && p == 2)
+            break; // went along with U
+        for(int y = 0; y < c->height[p]; y++) {
+            const uint16_t *bias = c->bias[y & 7];
+            for(int x = 0; x < c->width[p]; x += CONVERT_CHUNK) {
+                int n = c->width[p] - x < CONVERT_CHUNK ? c->width[p] - x : CONVERT_CHUNK;
+                const uint16_t *s = convert_read(c, src, p, y, x, n, tmp[0]);
+                if(interleave) {
+                    c->k->shift16(out[0], s, n, c->shl, c->shr, c->post, bias);
+                    s = convert_read(c, src, 2, y, x, n, tmp[1]);
+                    c->k->shift16(out[1], s, n, c->shl, c->shr, c->post, bias);
+                    c->k->interleave((uint16_t*)dst + 2 * x, out[0], out[1], n);
+                } else if(c->dst_bytes == 2)
+                    c->k->shift16((uint16_t*)dst + x, s, n, c->shl, c->shr, c->post, bias);
+                else
+                    c->k->shift8(dst + x, s, n, c->shl, c->shr, bias);
+            }
+            dst += (size_t)c->width[p] * c->dst_bytes * (interleave ? 2 : 1);
+        }
+    }
+}
@@ -0,0 +1,181 @@
+/*****************************************************************************
+ * file_sink.c: preallocated O_DIRECT and mmap writers for regular files (-io)
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *****************************************************************************/
+
+/* Both modes reserve the expected size of the file up front, so that a long intermediate
+ * ends up in few extents, and try to keep it out of the page cache:
+ *
+ *   direct  collects the stream in a page aligned staging buffer and writes it out in
+ *           whole blocks with O_DIRECT (F_NOCACHE on macOS). The unaligned tail is written
+ *           through the page cache at the end.
+ *   mmap    copies the stream into a window of the file mapped with MAP_SHARED. Windows
+ *           that are done are unmapped, written back and dropped from the cache.
+ *
+ * Data handed to file_sink_write() is only known to be on disk after file_sink_finish(),
+ * which also cuts the file back from the reserved to the written size. */
+
+enum { IO_BUFFERED, IO_DIRECT, IO_MMAP };
+
+#define FILE_SINK_ALIGN 4096
+#define FILE_SINK_STAGE (8 << 20)       // direct: staging buffer
+#define FILE_SINK_WINDOW (64 << 20)     // mmap: mapped window
+
+typedef struct {
+    int fd;
+    int mode;
+    int direct;             // O_DIRECT is in effect
+    int64_t offset;         // bytes written so far, the file position
+    BYTE *buf;              // direct: staging buffer, covering the file from 'base'
+                            // mmap: mapped window at 'base', NULL if there is none
+    int64_t base;
+    int64_t size;           // mmap: current file size
+} file_sink_t;
+
+#if defined(AVS_POSIX)
+#include <sys/mman.h>
+
+static int file_sink_pwrite(file_sink_t *s, const BYTE *data, size_t size, int64_t offset)
+{
+    while(size) {
+        ssize_t ret = pwrite(s->fd, data, size, offset);
+        if(ret < 0 && errno == EINTR)
+            continue;
+#if defined(O_DIRECT)
+        if(ret < 0 && errno == EINVAL && s->direct) {
+            // some filesystems take the flag but not the writes
+            s->direct = 0;
+            fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) & ~O_DIRECT);
+            continue;
+        }
+#endif
+        if(ret <= 0)
+            return -1;
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+/* starts writeback of a finished range and drops the one before it, which has had time to
+ * get to disk, from the page cache */
+static void file_sink_evict(file_sink_t *s, int64_t offset, int64_t size, int64_t prev)
+{
+#if defined(__linux__)
+    sync_file_range(s->fd, offset, size, SYNC_FILE_RANGE_WRITE);
+    if(prev >= 0) {
+        sync_file_range(s->fd, prev, size, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(s->fd, prev, size, POSIX_FADV_DONTNEED);
+    }
+#endif
+}
+
+static void file_sink_unmap(file_sink_t *s)
+{
+    if(!s->buf)
+        return;
+    munmap(s->buf, FILE_SINK_WINDOW);
+    s->buf = NULL;
+    file_sink_evict(s, s->base, FILE_SINK_WINDOW, s->base - FILE_SINK_WINDOW);
+}
+
+/* fd must be a regular file, empty and open for writing; 'expect' is its final size if known */
+static int file_sink_open(file_sink_t *s, int fd, int mode, int64_t expect)
+{
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    s->mode = mode;
+#if defined(__linux__)
+    if(expect > 0)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expect); // only a hint, not every filesystem can
+#endif
+    if(mode == IO_DIRECT) {
+        if(posix_memalign((void**)&s->buf, FILE_SINK_ALIGN, FILE_SINK_STAGE)) {
+            s->buf = NULL;
+            return -1;
+        }
+#if defined(O_DIRECT)
+        s->direct = !fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+#elif defined(F_NOCACHE)
+        fcntl(fd, F_NOCACHE, 1);
+#endif
+    }
+    return 0;
+}
+
+static int64_t file_sink_write(file_sink_t *s, const struct iovec *iov, int iovcnt)
+{
+    int64_t total = 0;
+    for(int i = 0; i < iovcnt; i++) {
+        const BYTE *data = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while(left) {
+            size_t n;
+            if(s->mode == IO_DIRECT) {
+                if(s->offset - s->base == FILE_SINK_STAGE) {
+                    if(file_sink_pwrite(s, s->buf, FILE_SINK_STAGE, s->base))
+                        return total;
+                    s->base += FILE_SINK_STAGE;
+                }
+                n = FILE_SINK_STAGE - (s->offset - s->base);
+            } else {
+                if(!s->buf || s->offset - s->base == FILE_SINK_WINDOW) {
+                    file_sink_unmap(s);
+                    s->base = s->offset / FILE_SINK_WINDOW * FILE_SINK_WINDOW;
+                    if(s->size < s->base + FILE_SINK_WINDOW) {
+                        if(ftruncate(s->fd, s->base + FILE_SINK_WINDOW))
+                            return total;
+                        s->size = s->base + FILE_SINK_WINDOW;
+                    }
+                    s->buf = mmap(NULL, FILE_SINK_WINDOW, PROT_WRITE, MAP_SHARED, s->fd, s->base);
+                    if(s->buf == MAP_FAILED) {
+                        s->buf = NULL;
+                        return total;
+                    }
+                }
+                n = FILE_SINK_WINDOW - (s->offset - s->base);
+            }
+            if(n > left)
+                n = left;
+            memcpy(s->buf + (s->offset - s->base), data, n);
+            data += n;
+            left -= n;
+            s->offset += n;
+            total += n;
+        }
+    }
+    return total;
+}
+
+/* writes out what is left and trims the file to the bytes written */
+static int file_sink_finish(file_sink_t *s)
+{
+    int err = 0;
+    if(s->mode == IO_DIRECT && s->buf) {
+        size_t fill = s->offset - s->base;
+        size_t aligned = fill / FILE_SINK_ALIGN * FILE_SINK_ALIGN;
+        err = aligned && file_sink_pwrite(s, s->buf, aligned, s->base);
+#if defined(O_DIRECT)
+        if(s->direct)
+            fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) & ~O_DIRECT);
+        s->direct = 0;
+#endif
+        err = err || (fill > aligned && file_sink_pwrite(s, s->buf + aligned, fill - aligned, s->base + aligned));
+        free(s->buf);
+        s->buf = NULL;
+    } else if(s->mode == IO_MMAP)
+        file_sink_unmap(s);
+    err = err || ftruncate(s->fd, s->offset) || lseek(s->fd, s->offset, SEEK_SET) != s->offset;
+    s->mode = IO_BUFFERED;
+    return err ? -1 : 0;
+}
+#else
+static int file_sink_open(file_sink_t *s, int fd, int mode, int64_t expect) { return -1; }
+static int64_t file_sink_write(file_sink_t *s, const struct iovec *iov, int iovcnt) { return 0; }
+static int file_sink_finish(file_sink_t *s) { return 0; }
+#endif
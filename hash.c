@@ -0,0 +1,247 @@
+/*****************************************************************************
+ * hash.c: per-frame CRC32C of the clip and a check against an earlier run (-hash, -hashcmp)
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *****************************************************************************/
+
+/* Every plane of an output frame gets a CRC32C of its visible bytes, row after row through
+ * frame_rows(), so the pitch padding and the way fields are woven or separated don't matter.
+ * The hashes are those of the clip as the script returns it, before any -bits conversion.
+ * The list is text:
+ *
+ *   # avs2yuv hash 1 crc32c YUV
+ *   <output frame> <source frame> <crc of each plane>
+ *   digest <crc>
+ *
+ * The digest is the CRC32C of all plane CRCs in order, little endian; it is only written when
+ * every frame of the run was hashed. -hashcmp reads such a list and stops at the first frame
+ * that differs. The CRC uses the SSE4.2 crc32 instruction where there is one, and a table
+ * otherwise. */
+
+#define HASH_VERSION 1
+
+typedef uint32_t (*hash_crc_t)(uint32_t crc, const BYTE *p, size_t n);
+
+typedef struct {
+    const char *name;       // -hash: the list written
+    const char *compare;    // -hashcmp: the list the frames are checked against
+    FILE *fh;
+    FILE *ref;
+    avs_hnd_t *avs_h;
+    int planes;
+    int plane_id[4];
+    char plane_name[5];
+    int row_bytes[4];
+    int height[4];
+    uint32_t digest;
+    int frames;
+    hash_crc_t crc;
+    const char *kernel;
+} hash_t;
+
+static uint32_t hash_table[256];
+
+static uint32_t hash_crc_c(uint32_t crc, const BYTE *p, size_t n)
+{
+    crc = ~crc;
+    while(n--)
+        crc = hash_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HASH_SSE42
+#include <immintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t hash_crc_sse42(uint32_t crc, const BYTE *p, size_t n)
+{
+    crc = ~crc;
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    for(; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+#endif
+    for(; n >= 4; p += 4, n -= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+    }
+    for(; n; n--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return ~crc;
+}
+#endif
+
+/* AVS2YUV_SIMD=c takes the table, as it does for the other kernels */
+static void hash_pick_crc(hash_t *h)
+{
+    for(uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        hash_table[i] = c;
+    }
+    const char *cap = getenv("AVS2YUV_SIMD");
+    h->crc = hash_crc_c;
+    h->kernel = "C";
+#if defined(HASH_SSE42)
+    if(!(cap && !strcmp(cap, "c")) && __builtin_cpu_supports("sse4.2")) {
+        h->crc = hash_crc_sse42;
+        h->kernel = "SSE4.2";
+    }
+#endif
+}
+
+/* the next frame line of the reference list; 0 at its end, -1 if it is malformed */
+static int hash_read_ref(hash_t *h, int *pos, int *frm, uint32_t *crc, uint32_t *digest)
+{
+    char line[256];
+    while(fgets(line, sizeof(line), h->ref)) {
+        if(line[0] == '#' || line[0] == '\n')
+            continue;
+        if(sscanf(line, "digest %"SCNx32, digest) == 1)
+            continue;
+        int n = sscanf(line, "%d %d %"SCNx32" %"SCNx32" %"SCNx32" %"SCNx32, pos, frm, &crc[0], &crc[1], &crc[2], &crc[3]);
+        return n == 2 + h->planes ? 1 : -1;
+    }
+    return 0;
+}
+
+static int hash_open(hash_t *h, avs_hnd_t *avs_h, const AVS_VideoInfo *inf)
+{
+    static const int yuv_planes[] = {AVS_PLANAR_Y, AVS_PLANAR_U, AVS_PLANAR_V, AVS_PLANAR_A};
+    static const int rgb_planes[] = {AVS_PLANAR_G, AVS_PLANAR_B, AVS_PLANAR_R, AVS_PLANAR_A};
+    int rgb = avs_h->func.avs_is_planar_rgb(inf) || avs_h->func.avs_is_planar_rgba(inf);
+    int planar = rgb || avs_h->func.avs_is_y(inf) || avs_h->func.avs_is_420(inf) || avs_h->func.avs_is_422(inf) ||
+                 avs_h->func.avs_is_444(inf) || avs_h->func.avs_is_yv411(inf);
+    h->avs_h = avs_h;
+    h->planes = planar ? avs_h->func.avs_num_components(inf) : 1;
+    for(int p = 0; p < h->planes; p++) {
+        // packed clips are one plane, the default one
+        h->plane_id[p] = !planar ? 0 : rgb ? rgb_planes[p] : yuv_planes[p];
+        h->plane_name[p] = !planar ? 'P' : (rgb ? "GBRA" : "YUVA")[p];
+        h->row_bytes[p] = avs_h->func.avs_row_size(inf, h->plane_id[p]);
+        h->height[p] = planar ? inf->height >> avs_h->func.avs_get_plane_height_subsampling(inf, h->plane_id[p]) : inf->height;
+    }
+    hash_pick_crc(h);
+    if(h->compare) {
+        char line[256], planes[8] = "";
+        int version = 0;
+        if(!(h->ref = fopen(h->compare, "r"))) {
+            fprintf(stderr, "Error: failed to open \"%s\".\n", h->compare);
+            return -1;
+        }
+        if(!fgets(line, sizeof(line), h->ref) || sscanf(line, "# avs2yuv hash %d crc32c %7s", &version, planes) != 2 ||
+           version != HASH_VERSION) {
+            fprintf(stderr, "Error: \"%s\" is not a hash list.\n", h->compare);
+            return -1;
+        }
+        if(strcmp(planes, h->plane_name)) {
+            fprintf(stderr, "Error: \"%s\" was made from a clip with %s planes, this one has %s.\n", h->compare, planes, h->plane_name);
+            return -1;
+        }
+    }
+    if(h->name) {
+        if(!(h->fh = fopen(h->name, "w"))) {
+            fprintf(stderr, "Error: failed to create \"%s\".\n", h->name);
+            return -1;
+        }
+        fprintf(h->fh, "# avs2yuv hash %d crc32c %s\n", HASH_VERSION, h->plane_name);
+    }
+    return 0;
+}
+
+/* hashes output frame 'pos', made of source frame 'frm'; 1 if it differs from the reference */
+static int hash_frame(hash_t *h, frame_t f, int pos, int frm)
+{
+    uint32_t crc[4];
+    for(int p = 0; p < h->planes; p++) {
+        plane_rows_t r;
+        frame_rows(h->avs_h, f, h->plane_id[p], &r);
+        crc[p] = 0;
+        for(int y = 0; y < h->height[p]; y++)
+            crc[p] = h->crc(crc[p], plane_row(&r, y), h->row_bytes[p]);
+        BYTE le[4] = {crc[p], crc[p] >> 8, crc[p] >> 16, crc[p] >> 24};
+        h->digest = h->crc(h->digest, le, 4);
+    }
+    h->frames++;
+    if(h->fh) {
+        fprintf(h->fh, "%d %d", pos, frm);
+        for(int p = 0; p < h->planes; p++)
+            fprintf(h->fh, " %08"PRIx32, crc[p]);
+        fprintf(h->fh, "\n");
+        if(ferror(h->fh)) {
+            fprintf(stderr, "Error: failed to write to \"%s\".\n", h->name);
+            return -1;
+        }
+    }
+    if(h->ref) {
+        int ref_pos, ref_frm;
+        uint32_t ref_crc[4], digest;
+        int ret = hash_read_ref(h, &ref_pos, &ref_frm, ref_crc, &digest);
+        if(ret <= 0) {
+            fprintf(stderr, "Error: \"%s\" %s frame %d.\n", h->compare, ret ? "is malformed at" : "ends before", pos);
+            return 1;
+        }
+        if(ref_pos != pos || ref_frm != frm) {
+            fprintf(stderr, "Error: \"%s\" has frame %d from source frame %d where this run has frame %d from source frame %d.\n",
+                    h->compare, ref_pos, ref_frm, pos, frm);
+            return 1;
+        }
+        for(int p = 0; p < h->planes; p++)
+            if(crc[p] != ref_crc[p]) {
+                fprintf(stderr, "Error: frame %d (source frame %d) differs from \"%s\" in plane %c.\n", pos, frm, h->compare, h->plane_name[p]);
+                return 1;
+            }
+    }
+    return 0;
+}
+
+/* whether -hash would overwrite the -hashcmp list; file identity needs inodes, so other
+ * platforms only compare the names */
+static int hash_same_list(const hash_t *h)
+{
+    if(!strcmp(h->name, h->compare))
+        return 1;
+#if defined(AVS_POSIX)
+    struct stat a, b;
+    return !stat(h->name, &a) && !stat(h->compare, &b) && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+#else
+    return 0;
+#endif
+}
+
+/* with 'complete' set, writes the digest and checks that the reference holds no more frames;
+ * a list cut short by an error or Ctrl+C has no digest, so it can't pass for a whole run */
+static int hash_close(hash_t *h, int complete)
+{
+    int err = 0;
+    if(h->ref) {
+        int pos, frm;
+        uint32_t crc[4], digest;
+        if(complete && hash_read_ref(h, &pos, &frm, crc, &digest)) {
+            fprintf(stderr, "Error: \"%s\" holds more than the %d frames rendered.\n", h->compare, h->frames);
+            err = 1;
+        }
+        fclose(h->ref);
+        h->ref = NULL;
+    }
+    if(h->fh) {
+        if(complete)
+            fprintf(h->fh, "digest %08"PRIx32"\n", h->digest);
+        if(fclose(h->fh)) {
+            fprintf(stderr, "Error: failed to write to \"%s\".\n", h->name);
+            err = 1;
+        }
+        h->fh = NULL;
+    }
+    return err ? -1 : 0;
+}
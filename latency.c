@@ -0,0 +1,114 @@
+/*****************************************************************************
+ * latency.c: fixed-bucket latency histograms
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *****************************************************************************/
+
+/* Latencies are counted in microseconds. Values below 8 get a bucket each; above that
+ * every power of two is split into 8 buckets, so a percentile read back from the
+ * histogram is never more than 12.5% above the real value. Adding a sample is a
+ * couple of shifts and an increment. */
+
+#define LATENCY_SUB_BITS 3
+#define LATENCY_BUCKETS (38 << LATENCY_SUB_BITS) // up to 2^39 us, about six days
+#define LATENCY_SLOWEST 10
+
+typedef struct {
+    int64_t count;
+    int64_t sum;
+    int64_t max;
+    int64_t bucket[LATENCY_BUCKETS];
+    int slowest_count;
+    struct {
+        int64_t us;
+        int frame;
+    } slowest[LATENCY_SLOWEST]; // slowest first
+} latency_t;
+
+static int latency_bucket(int64_t us)
+{
+    if(us < (1 << LATENCY_SUB_BITS))
+        return us < 0 ? 0 : us;
+    int e = 63 - __builtin_clzll(us);
+    int b = ((e - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + ((us >> (e - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+    return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+}
+
+/* largest value that falls into bucket b */
+static int64_t latency_bucket_max(int b)
+{
+    if(b < (1 << LATENCY_SUB_BITS))
+        return b;
+    int e = (b >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    int64_t base = (int64_t)((1 << LATENCY_SUB_BITS) + (b & ((1 << LATENCY_SUB_BITS) - 1))) << (e - LATENCY_SUB_BITS);
+    return base + ((int64_t)1 << (e - LATENCY_SUB_BITS)) - 1;
+}
+
+static void latency_add_slowest(latency_t *l, int64_t us, int frame)
+{
+    int i = l->slowest_count < LATENCY_SLOWEST ? l->slowest_count++ : LATENCY_SLOWEST;
+    if(i == LATENCY_SLOWEST && us <= l->slowest[LATENCY_SLOWEST-1].us)
+        return;
+    if(i == LATENCY_SLOWEST)
+        i--;
+    for(; i > 0 && l->slowest[i-1].us < us; i--)
+        l->slowest[i] = l->slowest[i-1];
+    l->slowest[i].us = us;
+    l->slowest[i].frame = frame;
+}
+
+/* frame < 0 keeps the sample out of the slowest frame list */
+static void latency_add(latency_t *l, int64_t us, int frame)
+{
+    l->count++;
+    l->sum += us;
+    if(us > l->max)
+        l->max = us;
+    l->bucket[latency_bucket(us)]++;
+    if(frame >= 0)
+        latency_add_slowest(l, us, frame);
+}
+
+static int64_t latency_percentile(const latency_t *l, double p)
+{
+    int64_t rank = (int64_t)(p * l->count + 0.999999);
+    int64_t seen = 0;
+    if(rank < 1)
+        rank = 1;
+    for(int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += l->bucket[b];
+        if(seen >= rank)
+            return latency_bucket_max(b) < l->max ? latency_bucket_max(b) : l->max;
+    }
+    return l->max;
+}
+
+static void json_string(FILE *fh, const char *s)
+{
+    fputc('"', fh);
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\')
+            fprintf(fh, "\\%c", *s);
+        else if((unsigned char)*s < 0x20)
+            fprintf(fh, "\\u%04x", *s);
+        else
+            fputc(*s, fh);
+    }
+    fputc('"', fh);
+}
+
+static void latency_json(FILE *fh, const latency_t *l)
+{
+    fprintf(fh, "{\"count\": %"PRId64", \"mean_us\": %"PRId64", \"p50_us\": %"PRId64", \"p95_us\": %"PRId64", \"p99_us\": %"PRId64", \"max_us\": %"PRId64,
+            l->count, l->count ? l->sum / l->count : 0, latency_percentile(l, .50), latency_percentile(l, .95), latency_percentile(l, .99), l->max);
+    if(l->slowest_count) {
+        fprintf(fh, ", \"slowest\": [");
+        for(int i = 0; i < l->slowest_count; i++)
+            fprintf(fh, "%s{\"frame\": %d, \"us\": %"PRId64"}", i ? ", " : "", l->slowest[i].frame, l->slowest[i].us);
+        fprintf(fh, "]");
+    }
+    fprintf(fh, "}");
+}
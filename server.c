@@ -0,0 +1,515 @@
+/*****************************************************************************
+ * server.c: persistent render server (-server) and its client (-client)
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *****************************************************************************/
+
+/* The server loads AviSynth once and keeps script environments between jobs. A client
+ * connects to the server's Unix socket and sends a server_request_t. The fd the frames
+ * should go to travels with it as SCM_RIGHTS ancillary data. The client then waits for the
+ * server_reply_t that ends the job. An imported clip is reused for as long as the script
+ * keeps its path, inode, size and mtime. Once its clip is stale or evicted, an idle
+ * environment imports the next script instead of a new one being created, so plugins
+ * stay loaded. */
+
+#define SERVER_MAGIC 0x53593241 // "A2YS"
+#define SERVER_VERSION 5
+#define SERVER_MAX_ENVS 64
+
+enum { SERVER_NEW_ENV, SERVER_REUSED_ENV, SERVER_REUSED_CLIP };
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t seek;
+    int32_t frames;         // 0 = up to the end of the clip
+    int32_t raw;
+    int32_t depth;
+    int32_t bits;           // the output format, see output_format_t
+    int32_t dither;
+    int32_t stacked;
+    int32_t pack;
+    int32_t limited;
+    int32_t alpha_plane;
+    int32_t fields;         // -fields
+    uint32_t fps_num;       // 0 = as reported by the script
+    uint32_t fps_den;
+    uint32_t par_width;
+    uint32_t par_height;
+    char script[4096];      // absolute path
+} server_request_t;
+
+typedef struct {
+    uint32_t magic;
+    int32_t status;         // 0 on success
+    int32_t frames;         // frames written to the fd
+    int32_t reused;         // SERVER_NEW_ENV, SERVER_REUSED_ENV or SERVER_REUSED_CLIP
+    char message[512];      // what went wrong if status is not 0
+} server_reply_t;
+
+#if defined(AVS_POSIX)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct {
+    avs_hnd_t avs_h;        // own environment and clip on the shared library
+    const AVS_VideoInfo *inf;
+    char script[4096];      // empty while no clip is held
+    int64_t ino;
+    int64_t size;
+    int64_t mtime;
+    int busy;
+    int64_t last_used;
+} server_env_t;
+
+typedef struct {
+    avs_hnd_t *library;
+    int keep;               // environments kept while idle
+    int reimport;           // import the script again for every job
+    int threads;
+    const memory_t *memory;     // -memmax already divided by keep
+    int nostderr;
+    server_env_t *envs[SERVER_MAX_ENVS];
+    int active;             // jobs in progress
+    int jobs;
+    pthread_mutex_t mutex;  // everything above but library
+    pthread_cond_t cond;
+} server_t;
+
+typedef struct {
+    server_t *srv;
+    int sock;
+} server_conn_t;
+
+static void server_drop_env(server_env_t *e)
+{
+    close_script(&e->avs_h);
+    free(e);
+}
+
+/* hands out an environment for the script; reuses its clip when it is still current */
+static server_env_t *server_take_env(server_t *srv, const char *script, const struct stat *st, int *reused)
+{
+    server_env_t *match = NULL;
+    server_env_t *stale = NULL;
+    server_env_t *lru = NULL;
+    int count = 0;
+    int slot = -1;
+    pthread_mutex_lock(&srv->mutex);
+    for(int i = 0; i < SERVER_MAX_ENVS; i++) {
+        server_env_t *e = srv->envs[i];
+        if(!e) {
+            if(slot < 0)
+                slot = i;
+            continue;
+        }
+        count++;
+        if(e->busy)
+            continue;
+        if(strcmp(e->script, script))
+            ;
+        else if(!srv->reimport && e->ino == (int64_t)st->st_ino && e->size == (int64_t)st->st_size && e->mtime == (int64_t)st->st_mtime)
+            match = e;
+        else
+            stale = e;
+        if(!lru || e->last_used < lru->last_used)
+            lru = e;
+    }
+    server_env_t *e = match;
+    *reused = SERVER_REUSED_CLIP;
+    if(!e && (stale || (lru && (count >= srv->keep || slot < 0)))) {
+        e = stale ? stale : lru;
+        *reused = SERVER_REUSED_ENV;
+    } else if(!e && slot >= 0) {
+        e = calloc(1, sizeof(server_env_t));
+        if(e) {
+            e->avs_h = *srv->library;
+            e->avs_h.env = NULL;
+            e->avs_h.clip = NULL;
+            srv->envs[slot] = e;
+        }
+        *reused = SERVER_NEW_ENV;
+    }
+    if(e)
+        e->busy = 1;
+    pthread_mutex_unlock(&srv->mutex);
+    return e;
+}
+
+/* marks the environment idle again and drops the least recently used ones beyond -keep */
+static void server_give_env(server_t *srv, server_env_t *e, int failed)
+{
+    pthread_mutex_lock(&srv->mutex);
+    e->busy = 0;
+    e->last_used = avs2yuv_mdate();
+    if(failed)
+        e->script[0] = 0;
+    for(;;) {
+        int count = 0;
+        int lru = -1;
+        for(int i = 0; i < SERVER_MAX_ENVS; i++)
+            if(srv->envs[i]) {
+                count++;
+                if(!srv->envs[i]->busy && (lru < 0 || srv->envs[i]->last_used < srv->envs[lru]->last_used))
+                    lru = i;
+            }
+        if(count <= srv->keep || lru < 0)
+            break;
+        server_drop_env(srv->envs[lru]);
+        srv->envs[lru] = NULL;
+    }
+    pthread_mutex_unlock(&srv->mutex);
+}
+
+/* imports the script unless the environment already holds a current clip of it */
+static int server_prepare(server_t *srv, server_env_t *e, const char *script, const struct stat *st, int reused)
+{
+    if(reused == SERVER_REUSED_CLIP)
+        return 0;
+    e->script[0] = 0;
+    if(e->avs_h.env ? import_script(&e->avs_h, script, &e->inf) : open_script(&e->avs_h, script, &e->inf))
+        return -1;
+    if(srv->threads && set_threads(&e->avs_h, script, &e->inf, srv->threads) < 0)
+        return -1;
+    set_memory(&e->avs_h, srv->memory);
+    snprintf(e->script, sizeof(e->script), "%s", script);
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    return 0;
+}
+
+/* writes the requested range to fd; the fd is closed in any case. Without an fd, the file
+ * 'output' is created once the clip checks out and removed again if the job fails (-batch). */
+static int server_render(server_env_t *e, const server_request_t *req, int fd, const char *output, server_reply_t *reply)
+{
+    avs_hnd_t *avs_h = &e->avs_h;
+    AVS_VideoInfo fields_inf;
+    frame_layout_t layout = {0};
+    layout.fields = field_mode(e->inf, req->fields);
+    const AVS_VideoInfo *inf = output_info(e->inf, layout.fields, &fields_inf);
+    output_t out = {0};
+    char csp_type[200] = "";
+    int retval = -1;
+    out.name = "client";
+    out.fd = fd;
+    out.y4m_header = !req->raw;
+    output_format_t fmt = {req->bits, req->dither, req->limited, req->stacked, req->pack, req->alpha_plane};
+    const char *format_error = fmt.pack < PACK_PLANAR || fmt.pack > PACK_V210 ? "unknown -pack layout" :
+                               fmt.bits && (fmt.bits < 8 || fmt.bits > 16) ? "unsupported -bits" :
+                               layout.fields == FIELDS_SEPARATE && e->inf->height & (avs_h->func.avs_is_420(e->inf) ? 3 : 1) ?
+                               "the height doesn't allow -fields" :
+                               clip_format(avs_h, inf, req->depth, &fmt, req->raw, 0, csp_type, &layout);
+    if(format_error) {
+        snprintf(reply->message, sizeof(reply->message), "%s", format_error);
+        goto fail;
+    }
+    int width = inf->width;
+    int height = inf->height;
+    if(clip_is_hack(avs_h, inf, req->depth)) {
+        if(width & 3 || (fmt.stacked && height & 3)) {
+            snprintf(reply->message, sizeof(reply->message), "avisynth %d-bit hack requires that %s is at least mod4", req->depth, width & 3 ? "width" : "height");
+            goto fail;
+        }
+        if(fmt.stacked)
+            height >>= 1;
+        else
+            width >>= 1;
+    }
+    if(!csp_type[0] && !req->raw) {
+        snprintf(reply->message, sizeof(reply->message), "unsupported colorspace, use -raw");
+        goto fail;
+    }
+    int start = req->seek;
+    int end = req->frames > 0 && req->frames <= inf->num_frames - start ? start + req->frames : inf->num_frames;
+    if(start < 0 || start >= inf->num_frames) {
+        snprintf(reply->message, sizeof(reply->message), "frame %d is out of range", start);
+        goto fail;
+    }
+    if(fd < 0 && (out.fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) < 0) {
+        snprintf(reply->message, sizeof(reply->message), "failed to create/open \"%.400s\"", output);
+        goto fail;
+    }
+    if(output_open(&out, &layout))
+        goto write_error;
+    if(out.y4m_header) {
+        char header[400];
+        unsigned fps_num = req->fps_num && req->fps_den ? req->fps_num : inf->fps_numerator;
+        unsigned fps_den = req->fps_num && req->fps_den ? req->fps_den : inf->fps_denominator;
+        int len = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%u:%u I%s A%u:%u %s\n", width, height, fps_num, fps_den,
+                           layout.fields == FIELDS_WEAVE ? avs_is_tff(e->inf) ? "t" : "b" : "p", req->par_width, req->par_height, csp_type);
+        if(output_write(&out, header, len) != len)
+            goto write_error;
+    }
+    for(int frm = start; frm < end; frm++) {
+        frame_t f = render_frame(avs_h, layout.fields, frm);
+        const char *err = avs_h->func.avs_clip_get_error(avs_h->clip);
+        if(err) {
+            frame_release(avs_h, f);
+            snprintf(reply->message, sizeof(reply->message), "%s occurred while reading frame %d", err, frm);
+            goto fail;
+        }
+        int64_t wrote = write_frame(&out, &layout, f);
+        frame_release(avs_h, f);
+        if(wrote != layout.frame_size)
+            goto write_error;
+        reply->frames++;
+    }
+    retval = 0;
+    goto fail;
+write_error:
+    snprintf(reply->message, sizeof(reply->message), "failed to write frame %d", req->seek + reply->frames);
+fail:
+    if(fd < 0 && out.fd >= 0 && retval)
+        unlink(output);
+    output_close(&out, &layout, !retval);
+    return retval;
+}
+
+/* receives the request and the fd sent along with it */
+static int server_receive(int sock, server_request_t *req, int *fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {req, sizeof(*req)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    *fd = -1;
+    ssize_t ret;
+    while((ret = recvmsg(sock, &msg, 0)) < 0 && errno == EINTR);
+    struct cmsghdr *cmsg = ret > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    if(ret <= 0 || (ret < (ssize_t)sizeof(*req) && read_full(sock, (char*)req + ret, sizeof(*req) - ret)))
+        return -1;
+    req->script[sizeof(req->script) - 1] = 0;
+    return req->magic == SERVER_MAGIC && req->version == SERVER_VERSION && *fd >= 0 ? 0 : -1;
+}
+
+/* runs the request on an environment of the server; the fd is closed in any case */
+static void server_handle(server_t *srv, const server_request_t *req, const struct stat *st, int fd, const char *output,
+                          server_reply_t *reply)
+{
+    int reused;
+    server_env_t *e = server_take_env(srv, req->script, st, &reused);
+    if(!e) {
+        snprintf(reply->message, sizeof(reply->message), "no free script environment");
+        if(fd >= 0)
+            close(fd);
+    } else if(server_prepare(srv, e, req->script, st, reused)) {
+        snprintf(reply->message, sizeof(reply->message), "failed to open \"%.400s\", see the log", req->script);
+        if(fd >= 0)
+            close(fd);
+        server_give_env(srv, e, 1);
+    } else {
+        reply->status = server_render(e, req, fd, output, reply) ? 1 : 0;
+        reply->reused = reused;
+        server_give_env(srv, e, 0);
+    }
+}
+
+static void *server_job(void *arg)
+{
+    server_conn_t *conn = arg;
+    server_t *srv = conn->srv;
+    server_request_t req;
+    server_reply_t reply = {SERVER_MAGIC};
+    struct stat st;
+    int fd;
+    int64_t start = avs2yuv_mdate();
+    pin_thread(1);
+    pthread_mutex_lock(&srv->mutex);
+    int job = ++srv->jobs;
+    pthread_mutex_unlock(&srv->mutex);
+    reply.status = 1;
+    if(server_receive(conn->sock, &req, &fd)) {
+        snprintf(reply.message, sizeof(reply.message), "malformed request");
+        req.script[0] = 0;
+        if(fd >= 0)
+            close(fd);
+    } else if(stat(req.script, &st)) {
+        snprintf(reply.message, sizeof(reply.message), "can't access \"%.400s\"", req.script);
+        close(fd);
+    } else
+        server_handle(srv, &req, &st, fd, NULL, &reply);
+    if(!srv->nostderr || reply.status) {
+        static const char *how[] = {"new environment", "environment reused", "clip reused"};
+        if(reply.status)
+            fprintf(stderr, "Job %d: %s: %s.\n", job, req.script, reply.message);
+        else
+            fprintf(stderr, "Job %d: %s, %d frames from %d in %.3f s (%s)\n", job, req.script, reply.frames, req.seek,
+                    (avs2yuv_mdate() - start) / 1000000., how[reply.reused]);
+    }
+    send(conn->sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+    close(conn->sock);
+    free(conn);
+    pthread_mutex_lock(&srv->mutex);
+    srv->active--;
+    pthread_cond_broadcast(&srv->cond);
+    pthread_mutex_unlock(&srv->mutex);
+    return NULL;
+}
+
+static int server_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Error: socket path \"%s\" is too long.\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* serves jobs until Ctrl+C, then waits for the running ones */
+static int server_run(const char *path, avs_hnd_t *library, int keep, int reimport, int threads, const memory_t *memory, int nostderr)
+{
+    struct sockaddr_un addr;
+    server_t srv = {0};
+    if(server_address(&addr, path))
+        return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0)
+        return -1;
+    if(!connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(stderr, "Error: a server is already listening on \"%s\".\n", path);
+        close(sock);
+        return -1;
+    }
+    unlink(path); // left behind by a server that didn't exit cleanly
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) || listen(sock, 64)) {
+        fprintf(stderr, "Error: failed to listen on \"%s\".\n", path);
+        close(sock);
+        return -1;
+    }
+    srv.library = library;
+    srv.keep = keep;
+    srv.reimport = reimport;
+    srv.threads = threads;
+    srv.memory = memory;
+    srv.nostderr = nostderr;
+    pthread_mutex_init(&srv.mutex, NULL);
+    pthread_cond_init(&srv.cond, NULL);
+    signal(SIGPIPE, SIG_IGN); // clients going away must not take the server with them
+    signal(SIGINT, sigintHandler);
+    if(!nostderr)
+        fprintf(stderr, "%s\nListening on %s, keeping up to %d environments.\n", MY_VERSION, path, keep);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while(!b_ctrl_c) {
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if(poll(&pfd, 1, 200) <= 0)
+            continue;
+        int client = accept(sock, NULL, NULL);
+        if(client < 0)
+            continue;
+        server_conn_t *conn = malloc(sizeof(server_conn_t));
+        pthread_t thread;
+        if(conn) {
+            conn->srv = &srv;
+            conn->sock = client;
+        }
+        pthread_mutex_lock(&srv.mutex);
+        srv.active++;
+        pthread_mutex_unlock(&srv.mutex);
+        if(!conn || pthread_create(&thread, &attr, server_job, conn)) {
+            close(client);
+            free(conn);
+            pthread_mutex_lock(&srv.mutex);
+            srv.active--;
+            pthread_mutex_unlock(&srv.mutex);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    close(sock);
+    unlink(path);
+    pthread_mutex_lock(&srv.mutex);
+    while(srv.active)
+        pthread_cond_wait(&srv.cond, &srv.mutex);
+    pthread_mutex_unlock(&srv.mutex);
+    for(int i = 0; i < SERVER_MAX_ENVS; i++)
+        if(srv.envs[i])
+            server_drop_env(srv.envs[i]);
+    pthread_mutex_destroy(&srv.mutex);
+    pthread_cond_destroy(&srv.cond);
+    if(!nostderr)
+        fprintf(stderr, "Served %d jobs.\n", srv.jobs);
+    return 0;
+}
+
+/* -client: hands the output over to a running server and waits for the job to finish */
+static int client_run(const char *path, server_request_t *req, const char *infile, output_t *out, int nostderr)
+{
+    struct sockaddr_un addr;
+    server_reply_t reply;
+    if(!realpath(infile, req->script)) {
+        fprintf(stderr, "Error: can't access \"%s\".\n", infile);
+        return 1;
+    }
+    if(server_address(&addr, path))
+        return 1;
+    // connect first, so an existing output is left alone when there is no server
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(stderr, "Error: no server is listening on \"%s\".\n", path);
+        if(sock >= 0)
+            close(sock);
+        return 1;
+    }
+    int fd = !strcmp(out->name, "-") ? fileno(stdout) : open(out->name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if(fd < 0) {
+        fprintf(stderr, "Error: failed to create/open \"%s\".\n", out->name);
+        close(sock);
+        return 1;
+    }
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {req, sizeof(*req)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    req->magic = SERVER_MAGIC;
+    req->version = SERVER_VERSION;
+    ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    close(fd); // the server holds its own copy now
+    if(sent != sizeof(*req) || read_full(sock, &reply, sizeof(reply)) || reply.magic != SERVER_MAGIC) {
+        fprintf(stderr, "Error: lost the connection to the server.\n");
+        close(sock);
+        return 1;
+    }
+    close(sock);
+    if(reply.status) {
+        fprintf(stderr, "Error: %.*s.\n", (int)sizeof(reply.message), reply.message);
+        return 1;
+    }
+    if(!nostderr)
+        fprintf(stderr, "Frames:\t\t%d (rendered by the server on \"%s\")\n", reply.frames, path);
+    return 0;
+}
+#else
+static int server_run(const char *path, avs_hnd_t *library, int keep, int reimport, int threads, const memory_t *memory, int nostderr)
+{
+    fprintf(stderr, "Error: -server is not supported on this platform.\n");
+    return -1;
+}
+
+static int client_run(const char *path, server_request_t *req, const char *infile, output_t *out, int nostderr)
+{
+    fprintf(stderr, "Error: -client is not supported on this platform.\n");
+    return 1;
+}
+#endif
@@ -0,0 +1,261 @@
+/*****************************************************************************
+ * shm_ring.c: shared memory frame ring
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *****************************************************************************/
+
+/* A ring is a POSIX shared memory object (/dev/shm/NAME on Linux) laid out as
+ *
+ *   shm_ring_header_t                       (SHM_RING_HEADER_SIZE bytes)
+ *   slot 0: shm_slot_header_t + frame data  (slot_size bytes, page aligned)
+ *   slot 1: ...
+ *
+ * All integers are in native byte order. The producer fills slot (seq % slots),
+ * stores seq + 1 into that slot's header and then advances write_seq. The consumer
+ * reads slots in order and advances read_seq once it is done with a slot; the
+ * producer never overwrites a slot before read_seq has moved past it. Both sequence
+ * counters are only ever written by one side and are accessed with acquire/release
+ * semantics. 'closed' is set by the producer after the last frame.
+ *
+ * Frame data is packed the way it is written to y4m and raw outputs: the planes one after
+ * another without row padding. Readers written in other languages can rely on the fixed
+ * offsets of shm_ring_header_t: write_seq at byte 128, read_seq at 136 and closed at 144. */
+
+#define SHM_RING_MAGIC "AVS2YUV"
+#define SHM_RING_VERSION 1
+#define SHM_RING_HEADER_SIZE 4096
+#define SHM_SLOT_HEADER_SIZE 64
+#define SHM_RING_FINISH_IDLE 10 // seconds shm_ring_finish() waits for a consumer that takes no slot
+
+typedef struct {
+    char magic[8];          // SHM_RING_MAGIC
+    uint32_t version;       // SHM_RING_VERSION
+    uint32_t slots;
+    uint64_t slot_size;     // bytes per slot, including its header
+    uint64_t frame_size;    // bytes of packed frame data a slot can hold
+    int32_t width;
+    int32_t height;
+    uint32_t fps_num;
+    uint32_t fps_den;
+    uint32_t par_width;
+    uint32_t par_height;
+    int32_t num_frames;
+    char interlace;         // 'p', 't' or 'b', as in the y4m header
+    char reserved[3];
+    char csp[64];           // y4m colorspace tag, e.g. "C420p10 XYSCSS=C420p10"; empty if there is none
+    uint64_t write_seq;     // slots published by the producer
+    uint64_t read_seq;      // slots released by the consumer
+    uint32_t closed;        // no more slots after write_seq
+} shm_ring_header_t;
+
+typedef struct {
+    uint64_t seq;           // sequence number + 1 of the frame in this slot
+    int32_t frame;          // frame number for -slave2, position in the stream for shm: outputs
+    int32_t status;         // 0 if the slot holds frame data
+    uint64_t size;          // bytes of frame data following the slot header
+} shm_slot_header_t;
+
+typedef struct {
+    shm_ring_header_t *hdr;
+    size_t map_size;
+    char name[256];
+    int owner;
+} shm_ring_t;
+
+/* copies the stream description (width up to csp) into a ring created by shm_ring_create */
+static void shm_ring_describe(shm_ring_t *r, const shm_ring_header_t *desc)
+{
+    memcpy(&r->hdr->width, &desc->width, offsetof(shm_ring_header_t, write_seq) - offsetof(shm_ring_header_t, width));
+}
+
+#if defined(AVS_POSIX)
+#include <sys/mman.h>
+
+static void shm_ring_pause(int *spins)
+{
+    struct timespec ts = {0, *spins < 100 ? 50000 : 1000000};
+    nanosleep(&ts, NULL);
+    (*spins)++;
+}
+
+/* names are given without the leading slash shm_open wants */
+static int shm_ring_path(shm_ring_t *r, const char *name)
+{
+    if(!*name || strchr(name, '/') || strlen(name) + 2 > sizeof(r->name))
+        return -1;
+    snprintf(r->name, sizeof(r->name), "/%s", name);
+    return 0;
+}
+
+/* creates the ring; geometry fields of r->hdr are left for the caller to fill in */
+static int shm_ring_create(shm_ring_t *r, const char *name, int slots, uint64_t frame_size)
+{
+    memset(r, 0, sizeof(*r));
+    if(shm_ring_path(r, name))
+        return -1;
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t slot_size = (SHM_SLOT_HEADER_SIZE + frame_size + page - 1) / page * page;
+    r->map_size = SHM_RING_HEADER_SIZE + slot_size * slots;
+    int fd = shm_open(r->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0)
+        return -1;
+    r->owner = 1;
+    if(ftruncate(fd, r->map_size)) {
+        close(fd);
+        shm_unlink(r->name);
+        return -1;
+    }
+    r->hdr = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(r->hdr == MAP_FAILED) {
+        r->hdr = NULL;
+        shm_unlink(r->name);
+        return -1;
+    }
+    memcpy(r->hdr->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC));
+    r->hdr->version = SHM_RING_VERSION;
+    r->hdr->slots = slots;
+    r->hdr->slot_size = slot_size;
+    r->hdr->frame_size = frame_size;
+    return 0;
+}
+
+static int shm_ring_open(shm_ring_t *r, const char *name)
+{
+    struct stat st;
+    memset(r, 0, sizeof(*r));
+    if(shm_ring_path(r, name))
+        return -1;
+    int fd = shm_open(r->name, O_RDWR, 0);
+    if(fd < 0)
+        return -1;
+    if(fstat(fd, &st) || st.st_size < SHM_RING_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    r->map_size = st.st_size;
+    r->hdr = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(r->hdr == MAP_FAILED) {
+        r->hdr = NULL;
+        return -1;
+    }
+    if(memcmp(r->hdr->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC)) || r->hdr->version != SHM_RING_VERSION ||
+       SHM_RING_HEADER_SIZE + r->hdr->slot_size * r->hdr->slots > r->map_size) {
+        munmap(r->hdr, r->map_size);
+        r->hdr = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static shm_slot_header_t *shm_ring_slot(shm_ring_t *r, uint64_t seq)
+{
+    return (shm_slot_header_t*)((char*)r->hdr + SHM_RING_HEADER_SIZE + (seq % r->hdr->slots) * r->hdr->slot_size);
+}
+
+static BYTE *shm_slot_data(shm_slot_header_t *slot)
+{
+    return (BYTE*)slot + SHM_SLOT_HEADER_SIZE;
+}
+
+/* producer: waits for a free slot and returns it; 'abort' is polled while waiting */
+static shm_slot_header_t *shm_ring_acquire(shm_ring_t *r, volatile int *abort)
+{
+    uint64_t seq = r->hdr->write_seq;
+    int spins = 0;
+    while(seq - __atomic_load_n(&r->hdr->read_seq, __ATOMIC_ACQUIRE) >= r->hdr->slots) {
+        if(abort && *abort)
+            return NULL;
+        shm_ring_pause(&spins);
+    }
+    return shm_ring_slot(r, seq);
+}
+
+/* producer: makes the slot returned by shm_ring_acquire visible to the consumer */
+static uint64_t shm_ring_publish(shm_ring_t *r, int frame, int status, uint64_t size)
+{
+    uint64_t seq = r->hdr->write_seq;
+    shm_slot_header_t *slot = shm_ring_slot(r, seq);
+    slot->frame = frame;
+    slot->status = status;
+    slot->size = size;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->hdr->write_seq, seq + 1, __ATOMIC_RELEASE);
+    return seq;
+}
+
+/* consumer: waits for the next slot; NULL once the producer closed the ring */
+static shm_slot_header_t *shm_ring_next(shm_ring_t *r, volatile int *abort)
+{
+    uint64_t seq = r->hdr->read_seq;
+    int spins = 0;
+    while(__atomic_load_n(&r->hdr->write_seq, __ATOMIC_ACQUIRE) <= seq) {
+        if(__atomic_load_n(&r->hdr->closed, __ATOMIC_ACQUIRE) && __atomic_load_n(&r->hdr->write_seq, __ATOMIC_ACQUIRE) <= seq)
+            return NULL;
+        if(abort && *abort)
+            return NULL;
+        shm_ring_pause(&spins);
+    }
+    return shm_ring_slot(r, seq);
+}
+
+/* consumer: hands the oldest slot back to the producer */
+static void shm_ring_release(shm_ring_t *r)
+{
+    __atomic_store_n(&r->hdr->read_seq, r->hdr->read_seq + 1, __ATOMIC_RELEASE);
+}
+
+/* producer: marks the end of the stream and waits for the consumer to take every slot. A consumer
+ * that never attached, or died, takes none for SHM_RING_FINISH_IDLE seconds and is given up on;
+ * returns the number of slots left unread */
+static uint64_t shm_ring_finish(shm_ring_t *r, volatile int *abort)
+{
+    int spins = 0;
+    uint64_t seen = __atomic_load_n(&r->hdr->read_seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&r->hdr->closed, 1, __ATOMIC_RELEASE);
+    for(;;) {
+        uint64_t read_seq = __atomic_load_n(&r->hdr->read_seq, __ATOMIC_ACQUIRE);
+        if(read_seq >= r->hdr->write_seq || (abort && *abort))
+            return r->hdr->write_seq - read_seq;
+        if(read_seq != seen) {
+            seen = read_seq;
+            spins = 0;
+        } else if(spins >= 100 + SHM_RING_FINISH_IDLE * 1000)
+            return r->hdr->write_seq - read_seq;
+        shm_ring_pause(&spins);
+    }
+}
+
+static void shm_ring_close(shm_ring_t *r)
+{
+    if(!r->hdr)
+        return;
+    if(r->owner)
+        __atomic_store_n(&r->hdr->closed, 1, __ATOMIC_RELEASE);
+    munmap(r->hdr, r->map_size);
+    r->hdr = NULL;
+}
+
+/* removes the name; readers that already mapped the ring keep it */
+static void shm_ring_unlink(shm_ring_t *r)
+{
+    if(r->owner)
+        shm_unlink(r->name);
+    r->owner = 0;
+}
+#else
+static int shm_ring_create(shm_ring_t *r, const char *name, int slots, uint64_t frame_size) { return -1; }
+static int shm_ring_open(shm_ring_t *r, const char *name) { return -1; }
+static BYTE *shm_slot_data(shm_slot_header_t *slot) { return NULL; }
+static shm_slot_header_t *shm_ring_acquire(shm_ring_t *r, volatile int *abort) { return NULL; }
+static uint64_t shm_ring_publish(shm_ring_t *r, int frame, int status, uint64_t size) { return 0; }
+static shm_slot_header_t *shm_ring_next(shm_ring_t *r, volatile int *abort) { return NULL; }
+static void shm_ring_release(shm_ring_t *r) {}
+static uint64_t shm_ring_finish(shm_ring_t *r, volatile int *abort) { return 0; }
+static void shm_ring_close(shm_ring_t *r) {}
+static void shm_ring_unlink(shm_ring_t *r) {}
+#endif
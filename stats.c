@@ -0,0 +1,396 @@
+/*****************************************************************************
+ * stats.c: per-frame plane statistics and scene cuts written next to the output (-stats)
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *****************************************************************************/
+
+/* For every output frame, each plane gets its minimum, maximum and average sample. It also
+ * gets the mean absolute difference to the same plane of the previous output frame. The
+ * values are those of the clip at its own depth (avs_bits_per_component), before any -bits
+ * conversion. The rows are read through frame_rows(), as the outputs read them, so woven
+ * or separated fields need no copy of their own. The kernels are plain C, SSE2 and AVX2,
+ * picked like those of convert.c.
+ *
+ * A scene cut is a frame whose first plane (luma, or G) differs from the frame before it
+ * by at least STATS_CUT_DIFF on the 8-bit scale, and by STATS_CUT_RATIO times the average
+ * difference of the STATS_HISTORY frames before that.
+ *
+ * The sidecar is CSV, one line per frame with a scene_cut column, or JSON if its name ends
+ * in ".json", where the frames are followed by the list of cuts by source frame, as
+ * -segment @FILE takes them. */
+
+#define STATS_CUT_DIFF 20.0
+#define STATS_CUT_RATIO 3.0
+#define STATS_HISTORY 8
+
+typedef struct {
+    unsigned min;
+    unsigned max;
+    uint64_t sum;
+    uint64_t sad;           // against the previous frame
+} stats_acc_t;
+
+typedef struct {
+    const char *name;
+    void (*row8)(stats_acc_t *a, const BYTE *cur, const BYTE *prev, int n);
+    void (*row16)(stats_acc_t *a, const uint16_t *cur, const uint16_t *prev, int n);
+} stats_kernels_t;
+
+typedef struct {
+    const char *name;
+    FILE *fh;
+    int json;
+    avs_hnd_t *avs_h;
+    int planes;
+    int plane_id[4];
+    char plane_name[4];
+    int width[4];           // samples
+    int height[4];
+    int bytes;              // per sample, 1 or 2
+    int bits;
+    frame_t prev;           // a reference to the previous output frame, NULL for the first one
+    double history[STATS_HISTORY];
+    int history_count;
+    int *cuts;              // source frames
+    int cut_count;
+    int cut_alloc;
+    int frames;
+    const stats_kernels_t *k;
+} stats_t;
+
+static void stats_row8_c(stats_acc_t *a, const BYTE *cur, const BYTE *prev, int n)
+{
+    for(int i = 0; i < n; i++) {
+        unsigned x = cur[i];
+        a->min = x < a->min ? x : a->min;
+        a->max = x > a->max ? x : a->max;
+        a->sum += x;
+        if(prev)
+            a->sad += x > prev[i] ? x - prev[i] : prev[i] - x;
+    }
+}
+
+static void stats_row16_c(stats_acc_t *a, const uint16_t *cur, const uint16_t *prev, int n)
+{
+    for(int i = 0; i < n; i++) {
+        unsigned x = cur[i];
+        a->min = x < a->min ? x : a->min;
+        a->max = x > a->max ? x : a->max;
+        a->sum += x;
+        if(prev)
+            a->sad += x > prev[i] ? x - prev[i] : prev[i] - x;
+    }
+}
+
+static const stats_kernels_t stats_kernels_c = {"C", stats_row8_c, stats_row16_c};
+
+#if defined(__SSE2__)
+static inline unsigned stats_hmin8_sse2(__m128i x)
+{
+    x = _mm_min_epu8(x, _mm_srli_si128(x, 8));
+    x = _mm_min_epu8(x, _mm_srli_si128(x, 4));
+    x = _mm_min_epu8(x, _mm_srli_si128(x, 2));
+    x = _mm_min_epu8(x, _mm_srli_si128(x, 1));
+    return _mm_cvtsi128_si32(x) & 0xff;
+}
+
+static inline unsigned stats_hmax8_sse2(__m128i x)
+{
+    x = _mm_max_epu8(x, _mm_srli_si128(x, 8));
+    x = _mm_max_epu8(x, _mm_srli_si128(x, 4));
+    x = _mm_max_epu8(x, _mm_srli_si128(x, 2));
+    x = _mm_max_epu8(x, _mm_srli_si128(x, 1));
+    return _mm_cvtsi128_si32(x) & 0xff;
+}
+
+static inline uint64_t stats_hsum64_sse2(__m128i x)
+{
+    uint64_t v[2];
+    _mm_storeu_si128((__m128i*)v, x);
+    return v[0] + v[1];
+}
+
+static void stats_row8_sse2(stats_acc_t *a, const BYTE *cur, const BYTE *prev, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i mn = _mm_set1_epi8(-1), mx = zero, sum = zero, sad = zero;
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(cur + i));
+        mn = _mm_min_epu8(mn, x);
+        mx = _mm_max_epu8(mx, x);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(x, zero));
+        if(prev)
+            sad = _mm_add_epi64(sad, _mm_sad_epu8(x, _mm_loadu_si128((const __m128i*)(prev + i))));
+    }
+    if(i) {
+        unsigned m = stats_hmin8_sse2(mn), M = stats_hmax8_sse2(mx);
+        a->min = m < a->min ? m : a->min;
+        a->max = M > a->max ? M : a->max;
+        a->sum += stats_hsum64_sse2(sum);
+        a->sad += stats_hsum64_sse2(sad);
+    }
+    stats_row8_c(a, cur + i, prev ? prev + i : NULL, n - i);
+}
+
+/* unsigned 16-bit min and max go through the signed ones with the top bit flipped;
+ * the sums are widened to 32-bit lanes, which hold rows of up to 256K samples */
+static void stats_row16_sse2(stats_acc_t *a, const uint16_t *cur, const uint16_t *prev, int n)
+{
+    const __m128i zero = _mm_setzero_si128(), flip = _mm_set1_epi16(-32768);
+    __m128i mn = _mm_set1_epi16(32767), mx = _mm_set1_epi16(-32768), sum = zero, sad = zero;
+    int i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(cur + i));
+        __m128i s = _mm_xor_si128(x, flip);
+        mn = _mm_min_epi16(mn, s);
+        mx = _mm_max_epi16(mx, s);
+        sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_unpacklo_epi16(x, zero), _mm_unpackhi_epi16(x, zero)));
+        if(prev) {
+            __m128i p = _mm_loadu_si128((const __m128i*)(prev + i));
+            __m128i d = _mm_or_si128(_mm_subs_epu16(x, p), _mm_subs_epu16(p, x));
+            sad = _mm_add_epi32(sad, _mm_add_epi32(_mm_unpacklo_epi16(d, zero), _mm_unpackhi_epi16(d, zero)));
+        }
+    }
+    if(i) {
+        int16_t m[8], M[8];
+        uint32_t s[4], d[4];
+        _mm_storeu_si128((__m128i*)m, mn);
+        _mm_storeu_si128((__m128i*)M, mx);
+        _mm_storeu_si128((__m128i*)s, sum);
+        _mm_storeu_si128((__m128i*)d, sad);
+        for(int k = 0; k < 8; k++) {
+            unsigned lo = (uint16_t)(m[k] ^ 0x8000), hi = (uint16_t)(M[k] ^ 0x8000);
+            a->min = lo < a->min ? lo : a->min;
+            a->max = hi > a->max ? hi : a->max;
+        }
+        a->sum += (uint64_t)s[0] + s[1] + s[2] + s[3];
+        a->sad += (uint64_t)d[0] + d[1] + d[2] + d[3];
+    }
+    stats_row16_c(a, cur + i, prev ? prev + i : NULL, n - i);
+}
+
+static const stats_kernels_t stats_kernels_sse2 = {"SSE2", stats_row8_sse2, stats_row16_sse2};
+#endif
+
+#if defined(CONVERT_AVX2)
+__attribute__((target("avx2")))
+static void stats_row8_avx2(stats_acc_t *a, const BYTE *cur, const BYTE *prev, int n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i mn = _mm256_set1_epi8(-1), mx = zero, sum = zero, sad = zero;
+    int i = 0;
+    for(; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(cur + i));
+        mn = _mm256_min_epu8(mn, x);
+        mx = _mm256_max_epu8(mx, x);
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(x, zero));
+        if(prev)
+            sad = _mm256_add_epi64(sad, _mm256_sad_epu8(x, _mm256_loadu_si256((const __m256i*)(prev + i))));
+    }
+    if(i) {
+        BYTE m[32], M[32];
+        uint64_t s[4], d[4];
+        _mm256_storeu_si256((__m256i*)m, mn);
+        _mm256_storeu_si256((__m256i*)M, mx);
+        _mm256_storeu_si256((__m256i*)s, sum);
+        _mm256_storeu_si256((__m256i*)d, sad);
+        for(int k = 0; k < 32; k++) {
+            a->min = m[k] < a->min ? m[k] : a->min;
+            a->max = M[k] > a->max ? M[k] : a->max;
+        }
+        a->sum += s[0] + s[1] + s[2] + s[3];
+        a->sad += d[0] + d[1] + d[2] + d[3];
+    }
+    stats_row8_c(a, cur + i, prev ? prev + i : NULL, n - i);
+}
+
+__attribute__((target("avx2")))
+static void stats_row16_avx2(stats_acc_t *a, const uint16_t *cur, const uint16_t *prev, int n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i mn = _mm256_set1_epi16(-1), mx = zero, sum = zero, sad = zero;
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(cur + i));
+        mn = _mm256_min_epu16(mn, x);
+        mx = _mm256_max_epu16(mx, x);
+        sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_unpacklo_epi16(x, zero), _mm256_unpackhi_epi16(x, zero)));
+        if(prev) {
+            __m256i p = _mm256_loadu_si256((const __m256i*)(prev + i));
+            __m256i d = _mm256_sub_epi16(_mm256_max_epu16(x, p), _mm256_min_epu16(x, p));
+            sad = _mm256_add_epi32(sad, _mm256_add_epi32(_mm256_unpacklo_epi16(d, zero), _mm256_unpackhi_epi16(d, zero)));
+        }
+    }
+    if(i) {
+        uint16_t m[16], M[16];
+        uint32_t s[8], d[8];
+        _mm256_storeu_si256((__m256i*)m, mn);
+        _mm256_storeu_si256((__m256i*)M, mx);
+        _mm256_storeu_si256((__m256i*)s, sum);
+        _mm256_storeu_si256((__m256i*)d, sad);
+        for(int k = 0; k < 16; k++) {
+            a->min = m[k] < a->min ? m[k] : a->min;
+            a->max = M[k] > a->max ? M[k] : a->max;
+        }
+        for(int k = 0; k < 8; k++) {
+            a->sum += s[k];
+            a->sad += d[k];
+        }
+    }
+    stats_row16_c(a, cur + i, prev ? prev + i : NULL, n - i);
+}
+
+static const stats_kernels_t stats_kernels_avx2 = {"AVX2", stats_row8_avx2, stats_row16_avx2};
+#endif
+
+/* AVS2YUV_SIMD caps these as it does the conversion kernels */
+static const stats_kernels_t *stats_pick_kernels(void)
+{
+    const char *cap = getenv("AVS2YUV_SIMD");
+    if(cap && !strcmp(cap, "c"))
+        return &stats_kernels_c;
+#if defined(CONVERT_AVX2)
+    if(!(cap && !strcmp(cap, "sse2")) && __builtin_cpu_supports("avx2"))
+        return &stats_kernels_avx2;
+#endif
+#if defined(__SSE2__)
+    return &stats_kernels_sse2;
+#else
+    return &stats_kernels_c;
+#endif
+}
+
+/* takes the plane geometry from the output timing of the clip and writes the head of the sidecar */
+static int stats_open(stats_t *s, avs_hnd_t *avs_h, const AVS_VideoInfo *inf, const char *script)
+{
+    static const int yuv_planes[] = {AVS_PLANAR_Y, AVS_PLANAR_U, AVS_PLANAR_V, AVS_PLANAR_A};
+    static const int rgb_planes[] = {AVS_PLANAR_G, AVS_PLANAR_B, AVS_PLANAR_R, AVS_PLANAR_A};
+    int rgb = avs_h->func.avs_is_planar_rgb(inf) || avs_h->func.avs_is_planar_rgba(inf);
+    int planar = rgb || avs_h->func.avs_is_y(inf) || avs_h->func.avs_is_420(inf) || avs_h->func.avs_is_422(inf) ||
+                 avs_h->func.avs_is_444(inf) || avs_h->func.avs_is_yv411(inf);
+    s->bytes = avs_h->func.avs_component_size(inf);
+    if(!planar || s->bytes > 2) {
+        fprintf(stderr, "Error: -stats needs a planar clip with integer samples.\n");
+        return -1;
+    }
+    s->avs_h = avs_h;
+    s->bits = avs_h->func.avs_bits_per_component(inf);
+    s->planes = avs_h->func.avs_num_components(inf);
+    for(int p = 0; p < s->planes; p++) {
+        s->plane_id[p] = rgb ? rgb_planes[p] : yuv_planes[p];
+        s->plane_name[p] = (rgb ? "GBRA" : "YUVA")[p];
+        s->width[p] = inf->width >> avs_h->func.avs_get_plane_width_subsampling(inf, s->plane_id[p]);
+        s->height[p] = inf->height >> avs_h->func.avs_get_plane_height_subsampling(inf, s->plane_id[p]);
+    }
+    const char *ext = strrchr(s->name, '.');
+    s->json = ext && !strcasecmp(ext, ".json");
+    if(!(s->fh = fopen(s->name, "w"))) {
+        fprintf(stderr, "Error: failed to create \"%s\".\n", s->name);
+        return -1;
+    }
+    s->k = stats_pick_kernels();
+    if(s->json) {
+        fprintf(s->fh, "{\n  \"version\": 1,\n  \"script\": ");
+        json_string(s->fh, script);
+        fprintf(s->fh, ",\n  \"bits\": %d,\n  \"planes\": \"%.*s\",\n  \"frames\": [", s->bits, s->planes, s->plane_name);
+    } else {
+        fprintf(s->fh, "frame,source");
+        for(int p = 0; p < s->planes; p++)
+            fprintf(s->fh, ",%c_min,%c_max,%c_avg,%c_diff", s->plane_name[p], s->plane_name[p], s->plane_name[p], s->plane_name[p]);
+        fprintf(s->fh, ",scene_cut\n");
+    }
+    return 0;
+}
+
+/* output frame 'pos', made of source frame 'frm' */
+static int stats_frame(stats_t *s, frame_t f, int pos, int frm)
+{
+    stats_acc_t acc[4];
+    for(int p = 0; p < s->planes; p++) {
+        plane_rows_t cur, prev = {{NULL}};
+        acc[p] = (stats_acc_t){~0u, 0, 0, 0};
+        frame_rows(s->avs_h, f, s->plane_id[p], &cur);
+        if(s->prev.frame)
+            frame_rows(s->avs_h, s->prev, s->plane_id[p], &prev);
+        for(int y = 0; y < s->height[p]; y++) {
+            const BYTE *c = plane_row(&cur, y);
+            const BYTE *q = s->prev.frame ? plane_row(&prev, y) : NULL;
+            if(s->bytes == 1)
+                s->k->row8(&acc[p], c, q, s->width[p]);
+            else
+                s->k->row16(&acc[p], (const uint16_t*)c, (const uint16_t*)q, s->width[p]);
+        }
+    }
+    // the first plane decides, on the 8-bit scale
+    double samples = (double)s->width[0] * s->height[0];
+    double diff = acc[0].sad / samples / (1 << (s->bits - 8));
+    int cut = 0;
+    if(s->prev.frame) {
+        double avg = 0;
+        for(int i = 0; i < s->history_count; i++)
+            avg += s->history[i] / s->history_count;
+        cut = diff >= STATS_CUT_DIFF && diff >= STATS_CUT_RATIO * avg;
+        memmove(s->history + 1, s->history, (STATS_HISTORY - 1) * sizeof(double));
+        s->history[0] = diff;
+        if(s->history_count < STATS_HISTORY)
+            s->history_count++;
+    }
+    if(cut) {
+        if(s->cut_count == s->cut_alloc) {
+            int *cuts = realloc(s->cuts, (s->cut_alloc = s->cut_alloc ? s->cut_alloc * 2 : 64) * sizeof(int));
+            if(!cuts)
+                return -1;
+            s->cuts = cuts;
+        }
+        s->cuts[s->cut_count++] = frm;
+    }
+    if(s->json)
+        fprintf(s->fh, "%s\n    {\"frame\": %d, \"source\": %d", s->frames ? "," : "", pos, frm);
+    else
+        fprintf(s->fh, "%d,%d", pos, frm);
+    for(int p = 0; p < s->planes; p++) {
+        double n = (double)s->width[p] * s->height[p];
+        if(s->json && s->prev.frame)
+            fprintf(s->fh, ", \"%c\": [%u, %u, %.3f, %.3f]", s->plane_name[p], acc[p].min, acc[p].max, acc[p].sum / n, acc[p].sad / n);
+        else if(s->json)
+            fprintf(s->fh, ", \"%c\": [%u, %u, %.3f, null]", s->plane_name[p], acc[p].min, acc[p].max, acc[p].sum / n);
+        else if(s->prev.frame)
+            fprintf(s->fh, ",%u,%u,%.3f,%.3f", acc[p].min, acc[p].max, acc[p].sum / n, acc[p].sad / n);
+        else
+            fprintf(s->fh, ",%u,%u,%.3f,", acc[p].min, acc[p].max, acc[p].sum / n);
+    }
+    if(s->json)
+        fprintf(s->fh, ", \"cut\": %s}", cut ? "true" : "false");
+    else
+        fprintf(s->fh, ",%d\n", cut);
+    frame_release(s->avs_h, s->prev);
+    s->prev = frame_ref(s->avs_h, f);
+    s->frames++;
+    return ferror(s->fh) ? -1 : 0;
+}
+
+/* finishes the sidecar; in JSON, the scene cuts are listed after the frames */
+static int stats_close(stats_t *s)
+{
+    if(!s->fh)
+        return 0;
+    if(s->json) {
+        fprintf(s->fh, "\n  ],\n  \"scene_cuts\": [");
+        for(int i = 0; i < s->cut_count; i++)
+            fprintf(s->fh, "%s%d", i ? ", " : "", s->cuts[i]);
+        fprintf(s->fh, "]\n}\n");
+    }
+    int err = fclose(s->fh);
+    s->fh = NULL;
+    frame_release(s->avs_h, s->prev);
+    s->prev.frame = s->prev.bottom = NULL;
+    free(s->cuts);
+    s->cuts = NULL;
+    if(err)
+        fprintf(stderr, "Error: failed to write to \"%s\".\n", s->name);
+    return err ? -1 : 0;
+}